@@ -3,20 +3,44 @@
 #include <FL/Fl_Button.H>
 #include <FL/Fl_Box.H>
 #include <FL/Fl_Input.H>
+#include <FL/Fl_Choice.H>
+#include <FL/Fl_Light_Button.H>
+#include <FL/Fl_Browser.H>
 #include <FL/fl_draw.H>
 #include <iostream>
 #include <vector>
 #include <iterator>
 #include <algorithm>
-#include <stack>
 #include <climits>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <memory>
+#include <fstream>
 #include <sstream>
+#include <map>
+#include <list>
+#include <cstring>
+#include <csignal>
+#include <cstdio>
+#include <new>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdint>
+#include <type_traits>
 
 #define int64 long long int
 #define ldouble long double
 
 // arbitrary for now
-#define MAX_CONSTANT_DIGITS 9
 #define MAX_CONSTANT_HEXDIGITS 10
 
 #define MAXY_UPPER_BOUND LLONG_MAX
@@ -33,10 +57,108 @@
 
 #define NUM_ALLOWED_OPERATORS 12
 
-#define MAX_SHIFTABLE_BITS 63LL
-#define MIN_SHIFTABLE_BITS 0LL
+#define BACKGROUND_RGB 0x000000
+#define AXIS_RGB 0x555555
+#define CURVE_RGB 0xff0000
+
+// edge length in pixels of a rasterization tile
+#define TILE_SIZE 64
+// line segments crossing more tiles than this are not binned per tile but
+// drawn in a second pass over horizontal bands, one band per worker
+#define SEGMENT_MAX_BINNED_TILES 4
+
+// default t range swept by the EVALUATE button
+#define SWEEP_FIRST_T (-2048LL)
+#define SWEEP_LAST_T 2048LL
+#define MAX_SWEEP_SAMPLES (1LL << 27)
+
+// level of detail pyramid: level L has 2^L x 2^L cells over the fitted
+// view, it is only built (and used) for sweeps of PYRAMID_MIN_SAMPLES or more
+#define PYRAMID_LEVELS 11
+#define PYRAMID_MIN_SAMPLES (1 << 20)
+// a segment costs its length in pixels, so sweeps with more samples than
+// this are drawn as points even in LINES mode
+#define LINES_MAX_SAMPLES (1 << 20)
+
+// mouse wheel zoom factor per step, and the smallest axis range zoomed to
+#define ZOOM_STEP 1.25
+#define MIN_ZOOM_RANGE 16.0
+
+// sweeps with more samples than this are not indexed for t queries,
+// those are answered by re-scanning the values instead
+#define INDEX_MAX_SAMPLES (1 << 26)
+#define RESCAN_CHUNK_SAMPLES (1 << 16)
+// t values listed for one query, the rest is only counted
+#define QUERY_MAX_LISTED 1000
+
+#define EXPORT_WIDTH 7680
+#define EXPORT_HEIGHT 4320
+
+// evaluation server (--serve) limits
+#define SERVER_QUEUED_REQUESTS 64
+// a client that does not take its reply for this long is dropped
+#define SERVER_SEND_TIMEOUT_SECONDS 10
+#define SERVER_PROGRAM_CACHE_SIZE 256
+#define SERVER_MAX_REQUEST_BYTES (16*1024*1024)
+#define SERVER_MAX_SAMPLES (1LL << 24)
+#define SERVER_MAX_IMAGE_SIDE 16384
+
+// largest side accepted by the headless --image export
+#define IMAGE_MAX_SIDE 32768
+
+// bytebeat audio: samples evaluated per chunk, size of the buffer the
+// evaluation runs ahead in (a power of two), and the "WAV" button settings
+#define BYTEBEAT_CHUNK_SAMPLES 4096
+#define BYTEBEAT_RING_SAMPLES (1 << 16)
+#define BYTEBEAT_MAX_RATE 192000
+#define BYTEBEAT_EXPORT_RATE 8000
+#define BYTEBEAT_EXPORT_SECONDS 30
+// unsigned 8-bit PCM silence, written for faulted samples
+#define BYTEBEAT_SILENCE 128
+
+// bit-sliced evaluation handles t values in groups of BITSLICE_LANES and is
+// only tried for sweeps of at least BITSLICE_MIN_SAMPLES
+#define BITSLICE_LANES 64
+#define BITSLICE_MIN_SAMPLES 256
+// Transposing t in and the results out costs about as much as 6 scalar
+// instructions per sample, and each bit-sliced instruction gets dearer with
+// the width, so short programs need BITSLICE_MIN_INSTRUCTIONS + bits/16
+// instructions before bit slicing pays off
+#define BITSLICE_MIN_INSTRUCTIONS 6
+
+// recursion limit for parenthesis and unary operator nesting
+#define MAX_PARSE_DEPTH 4096
+
+enum int_width_value {
+     INT_WIDTH_S8,
+     INT_WIDTH_U8,
+     INT_WIDTH_S16,
+     INT_WIDTH_U16,
+     INT_WIDTH_S32,
+     INT_WIDTH_U32,
+     INT_WIDTH_S64,
+     INT_WIDTH_U64
+};
+
+// order must match int_width_value (entries for the width Fl_Choice)
+static const char *int_width_names = "int8|uint8|int16|uint16|int32|uint32|int64|uint64";
+
+enum render_mode_value {
+     RENDER_MODE_POINTS,
+     RENDER_MODE_LINES
+};
 
-static const char global_delim = '$';
+// curves plot (x(t), y(t)), images color pixel (t,s) by the x expression
+enum plot_mode_value {
+     PLOT_MODE_CURVE,
+     PLOT_MODE_IMAGE
+};
+
+// inclusive pixel rectangle
+struct clipRect {
+   int minx, miny;
+   int maxx, maxy;
+};
 
 struct displayParameters {
    ldouble vis_maxx, vis_minx;
@@ -45,6 +167,8 @@ struct displayParameters {
    ldouble maxx, minx;
    ldouble maxy, miny;
    int incx;
+   // values are uint64 bit patterns stored in int64 (see plotValue)
+   bool unsigned_values;
 };
 
 // refactor globals later
@@ -52,16 +176,27 @@ std::string temp_global_stry = "-((t&1ff)*(~t&1ff)>>9)*((((((t^(t<<1f))-(t<<1f))
 std::string temp_global_strx = "-(((t-ff)&1ff)*(~(t-ff)&1ff)>>9)*(((((((t-ff)^((t-ff)<<1f))-((t-ff)<<1f))%400)/200)*2)-1)";
 Fl_Input *inpy;
 Fl_Input *inpx;
+Fl_Input *inpt0;
+Fl_Input *inpt1;
+Fl_Browser *query_browser;
 bool parse_success = false;
+int_width_value global_int_width = INT_WIDTH_S64;
+render_mode_value global_render_mode = RENDER_MODE_POINTS;
+plot_mode_value global_plot_mode = PLOT_MODE_CURVE;
+int64 global_sweep_first = SWEEP_FIRST_T;
+int64 global_sweep_last = SWEEP_LAST_T;
 // ...
 
 static const int operator_prec[NUM_ALLOWED_OPERATORS] = {
      0,0,1,1,1,2,2,3,3,4,5,6
 };
 
+// OPERATOR_CST and OPERATOR_VAR only appear as instructions of a compiled
+// program (push a constant / push the variable named by the instruction
+// value); operator_prec starts at OPERATOR_NOT
 enum operator_value {
-     OPERATOR_OPP,
-     OPERATOR_CDP,
+     OPERATOR_CST,
+     OPERATOR_VAR,
      OPERATOR_NOT,
      OPERATOR_NEG,
      OPERATOR_MUL,
@@ -76,23 +211,70 @@ enum operator_value {
      OPERATOR_IOR
 };
 
+enum variable_value {
+     VARIABLE_T,
+     VARIABLE_S
+};
+
 enum token_type {
      TOKEN_CONSTANT_OPERAND,
      TOKEN_VARIABLE_OPERAND,
      TOKEN_INFIX_OPERATOR,
      TOKEN_PREFIX_OPERATOR,
      TOKEN_PARENTHESIS_OPEN,
-     TOKEN_PARENTHESIS_CLOSE
+     TOKEN_PARENTHESIS_CLOSE,
+     TOKEN_END,
+     TOKEN_INVALID
+};
+
+enum parse_error_value {
+     PARSE_ERROR_NONE,
+     PARSE_ERROR_EMPTY,
+     PARSE_ERROR_INVALID_CHAR,
+     PARSE_ERROR_CONSTANT_TOO_LONG,
+     PARSE_ERROR_SINGLE_SHIFT,
+     PARSE_ERROR_EXPECTED_OPERAND,
+     PARSE_ERROR_EXPECTED_OPERATOR,
+     PARSE_ERROR_MISSING_CLOSE,
+     PARSE_ERROR_UNMATCHED_CLOSE,
+     PARSE_ERROR_TOO_DEEP,
+     PARSE_ERROR_S_OUTSIDE_IMAGE
+};
+
+// order must match parse_error_value
+static const char *parse_error_messages[] = {
+     "no error",
+     "empty expression",
+     "invalid character",
+     "constant has too many digits",
+     "shift operators are << and >>",
+     "expected operand",
+     "expected operator",
+     "missing ')'",
+     "unmatched ')'",
+     "expression nested too deeply",
+     "s is only defined in image mode"
+};
+
+enum fault_value {
+     FAULT_NONE,
+     FAULT_FPE,
+     FAULT_UDF
 };
 
+// tokens refer back into the expression text by position, nothing is copied
 struct token {
-     std::string value;
      token_type type;
+     operator_value op;
+     parse_error_value error;
+     int pos;
+     int64 value;
 };
 
-bool isVariable(char c) {
-     return c == 't';
-}
+struct instruction {
+     operator_value op;
+     int64 value;
+};
 
 bool isDigit(char c) {
      return (int)c >= (int)'0' &&
@@ -103,126 +285,377 @@ bool isHexDigit(char c) {
      return isDigit(c) || (c >= (int)'a' && c <= (int)'f');
 }
 
-bool isOperatorChar(char c) {
-     return c == '~' || c == '*' || c == '/' || c == '%' || c == '+' || c == '-' || c == '>' || c == '<' || c == '&' || c == '^' || c == '|';
+int64 getHexDigitValue(char c) {
+     return isDigit(c) ? (int64)(c - '0') : (int64)(c - 'a' + 10);
 }
 
-bool isParenthesis(char c) {
-     return c == '(' || c == ')';
-}
+// Arithmetic on the evaluation type T with two's complement wrapping.
+// Everything is computed in an unsigned type at least as wide as int so
+// that integer promotion of narrow types can never overflow a signed int.
+// Results are widened to int64 for the values buffer (uint64 values above
+// LLONG_MAX keep their bit pattern).
+template <typename T>
+struct wrapping {
+     typedef typename std::common_type<typename std::make_unsigned<T>::type, unsigned int>::type utype;
 
-bool isPotentiallyBeforeUnaryMinus(char c) {
-     return isOperatorChar(c) || c == '(';
-}
+     static const int64 bits = (int64)(sizeof(T)*CHAR_BIT);
 
-bool isPrefixOperatorIndicatorChar(char c) {
-     return c == '~' || c == 'u';
-}
+     static T fromInt64(int64 v) {
+          return (T)(unsigned long long)v;
+     }
 
-operator_value getTokenOperatorEquivalent(token tok)  {
-     switch(tok.value[0]) {
-         case('~'):
-              return OPERATOR_NOT;
-         case('u'):
-              return OPERATOR_NEG;
-         case('*'):
-              return OPERATOR_MUL;
-         case('/'):
-              return OPERATOR_DIV;
-         case('%'):
-              return OPERATOR_MOD;
-         case('+'):
-              return OPERATOR_ADD;
-         case('-'):
-              return OPERATOR_SUB;
-         case('<'):
-              return OPERATOR_LSF;
-         case('>'):
-              return OPERATOR_RSF;
-         case('&'):
-              return OPERATOR_AND;
-         case('^'):
-              return OPERATOR_XOR;
-         default:
-              break;
+     static int64 toInt64(T v) {
+          return (int64)v;
      }
 
-     return OPERATOR_IOR;
-}
+     static bool isMinusOne(T v) {
+          return std::is_signed<T>::value && v == (T)-1;
+     }
+
+     // the shift amount must lie in [0, bits-1] for the evaluation type
+     static bool shiftable(T v) {
+          int64 amount = toInt64(v);
+          return amount >= 0LL && amount < bits;
+     }
 
-token_type getTokenType(std::string str) {
-    const char c = str[0];
+     static T neg(T v) { return (T)((utype)0 - (utype)v); }
+     static T add(T a, T b) { return (T)((utype)a + (utype)b); }
+     static T sub(T a, T b) { return (T)((utype)a - (utype)b); }
+     static T mul(T a, T b) { return (T)((utype)a * (utype)b); }
+     // MIN / -1 wraps to MIN (and MIN % -1 is 0) instead of trapping
+     static T div(T a, T b) { return isMinusOne(b) ? neg(a) : (T)(a / b); }
+     static T mod(T a, T b) { return isMinusOne(b) ? (T)0 : (T)(a % b); }
+     static T lsf(T a, T b) { return (T)((utype)a << toInt64(b)); }
+     static T rsf(T a, T b) { return (T)(a >> toInt64(b)); }
+};
 
-    if (c == '(')
-        return TOKEN_PARENTHESIS_OPEN;
-    if (c == ')')
-        return TOKEN_PARENTHESIS_CLOSE;
-    if (isHexDigit(c))
-        return TOKEN_CONSTANT_OPERAND;
-    if (isVariable(c))
-        return TOKEN_VARIABLE_OPERAND;
-    if (isPrefixOperatorIndicatorChar(c))
-        return TOKEN_PREFIX_OPERATOR;
+// v2 op v1 for the binary operators, faults are reported instead of computed
+template <typename T>
+fault_value applyOperator(operator_value op, T v2, T v1, T &result) {
+    typedef wrapping<T> wrap;
 
-    return TOKEN_INFIX_OPERATOR;
-}
+    switch(op) {
+           case(OPERATOR_MUL):
+                result = wrap::mul(v2,v1);
+                break;
+           case(OPERATOR_DIV):
+                if (v1 == (T)0)
+                    return FAULT_FPE;
+                result = wrap::div(v2,v1);
+                break;
+           case(OPERATOR_MOD):
+                if (v1 == (T)0)
+                    return FAULT_FPE;
+                result = wrap::mod(v2,v1);
+                break;
+           case(OPERATOR_ADD):
+                result = wrap::add(v2,v1);
+                break;
+           case(OPERATOR_SUB):
+                result = wrap::sub(v2,v1);
+                break;
+           case(OPERATOR_LSF):
+                if (!wrap::shiftable(v1))
+                    return FAULT_UDF;
+                result = wrap::lsf(v2,v1);
+                break;
+           case(OPERATOR_RSF):
+                if (!wrap::shiftable(v1))
+                    return FAULT_UDF;
+                result = wrap::rsf(v2,v1);
+                break;
+           case(OPERATOR_AND):
+                result = (T)(v2 & v1);
+                break;
+           case(OPERATOR_XOR):
+                result = (T)(v2 ^ v1);
+                break;
+           case(OPERATOR_IOR):
+                result = (T)(v2 | v1);
+                break;
+           default:
+                break;
+    }
 
-// experimental
-int64 getint64FromHexStr(std::string h) {
-    int64 result;
-    std::stringstream ss;
-    ss << std::hex << h;
-    ss >> result;
-    return result;
+    return FAULT_NONE;
 }
 
+// postfix instruction list produced by expression_parser; instances are
+// only read during evaluation so one program can be shared between threads
+class program {
+    public:
+         program();
+         void clear();
+         void emit(operator_value, int64);
+         int getStackDepth() const;
+         int getNumInstructions() const;
+         const std::vector<instruction> &getInstructions() const;
+         template <typename T> fault_value evaluate(int64, int64, T *, T &) const;
+    private:
+         std::vector<instruction> instructions;
+         int depth;
+         int max_depth;
+};
+
+fault_value evaluateProgram(const program &, int_width_value, int64, int64, std::vector<int64> &, int64 &);
+
+// single pass over the expression text, one token per call
+class lexer {
+    public:
+         void init(const char *, int);
+         token next();
+    private:
+         const char *src;
+         int len;
+         int pos;
+};
+
+// Pratt parser that emits postfix code into a program while reading tokens,
+// so validation and compilation are one pass. The program keeps its capacity
+// between parses, re-parsing a similar expression does not allocate.
+class expression_parser {
+    public:
+         expression_parser();
+         bool parse(const std::string &, program &);
+         void allowVariableS(bool);
+         parse_error_value getError();
+         int getErrorColumn();
+    private:
+         void advance();
+         void fail(parse_error_value, int);
+         void parseBinary(program &, int, int);
+         void parseUnary(program &, int);
+         lexer lex;
+         token current;
+         parse_error_value error;
+         int error_pos;
+         bool allow_s;
+};
+
+class framebuffer;
+
 void evaluateButton_CB(Fl_Widget *, void *);
 void modifyExpressionXString_CB(Fl_Widget *, void *);
 void modifyExpressionYString_CB(Fl_Widget *, void *);
+void modifyIntWidth_CB(Fl_Widget *, void *);
+void modifyRenderMode_CB(Fl_Widget *, void *);
+void modifyPlotMode_CB(Fl_Widget *, void *);
+void bytebeatButton_CB(Fl_Widget *, void *);
+void exportButton_CB(Fl_Widget *, void *);
+void modifySweepRange_CB(Fl_Widget *, void *);
 
 class evaluator {
     public:
          evaluator();
          void init(std::string);
-         bool canPerformScopeOperation(operator_value);
-         void separateStringTokens(std::string);
-         void simplifyExpression(int64);
-         void performOperation(int64);
-         void resetStacks();
+         void parseExpression(std::string);
+         void setIntWidth(int_width_value);
+         void setImageMode(bool);
+         void evaluateRange(int64, int64);
+         void evaluateImage(framebuffer &);
+         bool writeBytebeat(const std::string &, int, int64);
          void clearValues();
-         void populateParseTokens();
          void resetInvalidIndices();
-         bool checkInvalidChars();
-         bool checkInvalidExpression();
          bool currentExpressionBad();
          bool evaluationErrorOccurred();
          bool FPEOccurred();
          bool UDFOccurred();
+         int getErrorColumn();
          int getNumValues();
-         int64 queryMinValue();
-         int64 queryMaxValue();
+         ldouble queryMinValue();
+         ldouble queryMaxValue();
+         bool valuesUnsigned();
          int64 getValue(int);
+         const std::vector<int64> &getValues();
+         std::string getErrorMessage();
          std::string getExpressionString();
     private:
-         std::stack<operator_value> operators;
-         std::stack<int64> operands;
-         std::vector<std::string> expression_vec;
-         std::vector<char> parse_results;
-         std::vector<token> tokens;
+         expression_parser parser;
+         program prog;
          std::vector<int64> values;
          std::string expression_str;
+         int_width_value int_width;
          bool bad_expression;
          int64 fpe_index;
          int64 udf_index;
 };
 
+// Fixed set of worker threads. submit() queues a task, blocking while
+// max_queued tasks are already waiting; parallelFor() spreads indices over
+// the workers and the calling thread and returns when all are done.
+class thread_pool {
+    public:
+         thread_pool(int, int);
+         ~thread_pool();
+         int getNumThreads();
+         void submit(std::function<void()>);
+         void parallelFor(int, const std::function<void(int)> &);
+    private:
+         void workerLoop();
+         std::vector<std::thread> workers;
+         std::deque<std::function<void()> > tasks;
+         std::mutex mtx;
+         std::condition_variable task_cv;
+         std::condition_variable space_cv;
+         int max_queued;
+         bool stopping;
+};
+
+thread_pool &getThreadPool();
+
+enum reply_status_value {
+     REPLY_POINTS,
+     REPLY_IMAGE,
+     REPLY_PARSE_ERROR,
+     REPLY_FAULT,
+     REPLY_BAD_REQUEST
+};
+
+// compiled programs shared by all server connections, least recently used
+// entries are dropped once SERVER_PROGRAM_CACHE_SIZE is reached
+class program_cache {
+    public:
+         std::shared_ptr<const program> lookup(const std::string &, parse_error_value &, int &);
+    private:
+         typedef std::list<std::pair<std::string, std::shared_ptr<const program> > > entry_list;
+         entry_list entries;
+         std::map<std::string, entry_list::iterator> index;
+         std::mutex mtx;
+};
+
+int runEvaluationServer(const char *);
+
+// Single producer, single consumer byte queue. write() sleeps while the
+// buffer is full and read() while it is empty and not closed. head and tail
+// only grow, their difference is the fill level. Only the counters are
+// guarded by the mutex: each side copies into the part of the buffer the
+// other side cannot touch until the counter moves.
+class byte_ring {
+    public:
+         byte_ring(size_t);
+         void write(const unsigned char *, size_t);
+         size_t read(unsigned char *, size_t);
+         void close();
+    private:
+         std::vector<unsigned char> data;
+         size_t mask;
+         size_t head;
+         size_t tail;
+         bool closed;
+         std::mutex mtx;
+         std::condition_variable space_cv;
+         std::condition_variable data_cv;
+};
+
+bool streamBytebeat(const program &, int_width_value, int, int64, bool, std::ostream &);
+
+// RGB canvas handed to fl_draw_image in one call
+class framebuffer {
+    public:
+         framebuffer();
+         void resize(int, int);
+         void clear(unsigned int);
+         void setPixel(int, int, unsigned int);
+         void fillRect(const clipRect &, unsigned int);
+         bool writePPM(const std::string &);
+         int getWidth();
+         int getHeight();
+         clipRect getBounds();
+         const unsigned char *getPixels();
+    private:
+         std::vector<unsigned char> pixels;
+         int width, height;
+};
+
+bool clipSegment(ldouble &, ldouble &, ldouble &, ldouble &, const clipRect &);
+bool clipSegmentToPixels(ldouble, ldouble, ldouble, ldouble, const clipRect &, int64 *);
+void rasterizeSegment(framebuffer &, ldouble, ldouble, ldouble, ldouble, const clipRect &, const clipRect &, unsigned int);
+ldouble plotValue(const displayParameters &, int64);
+void valueRange(const std::vector<int64> &, bool, ldouble &, ldouble &);
+void mapSample(const displayParameters &, ldouble, ldouble, ldouble &, ldouble &);
+bool pixelOfPosition(ldouble, ldouble, int, int, int &, int &);
+bool sameView(const displayParameters &, const displayParameters &);
+void fitDisplayParameters(displayParameters &, ldouble, ldouble, ldouble, ldouble);
+std::string formatCoordinate(ldouble);
+
+// Splits the framebuffer into TILE_SIZE squares. Samples (or segments between
+// consecutive samples) are binned by tile with a counting sort, then one pool
+// task per tile clears it, draws its part of the axes and its bin. Tiles are
+// disjoint so tasks write straight into the framebuffer without locking.
+class tile_rasterizer {
+    public:
+         tile_rasterizer();
+         void render(framebuffer &, const std::vector<ldouble> &, const std::vector<ldouble> &, render_mode_value, int, int);
+    private:
+         void binPoints(const std::vector<ldouble> &, const std::vector<ldouble> &);
+         void binSegments(const std::vector<ldouble> &, const std::vector<ldouble> &);
+         void renderTile(framebuffer &, int, const std::vector<ldouble> &, const std::vector<ldouble> &, render_mode_value, int, int);
+         void renderLongSegments(framebuffer &, const std::vector<ldouble> &, const std::vector<ldouble> &);
+         int getSegmentTiles(const std::vector<ldouble> &, const std::vector<ldouble> &, int, int *);
+         template <typename F> void forEachSegmentTile(const int64 *, F);
+         std::vector<int> sample_tile;
+         std::vector<size_t> bin_offsets;
+         std::vector<int> bin_entries;
+         std::vector<int> long_segments;
+         clipRect bounds;
+         int tiles_x, tiles_y;
+};
+
+// Compressed pixel -> sample index map for one view: only occupied pixels
+// are stored (sorted), each with a run of sample indices in entries.
+// Samples land on the pixel the points mode draws them at.
+class t_index {
+    public:
+         t_index();
+         void clear();
+         bool isValidFor(const displayParameters &);
+         void build(const displayParameters &, const std::vector<int64> &, const std::vector<int64> &);
+         void query(const clipRect &, std::vector<int> &);
+    private:
+         displayParameters view;
+         std::vector<unsigned int> pixels;
+         std::vector<unsigned int> offsets;
+         std::vector<unsigned int> entries;
+         int width;
+         bool valid;
+};
+
+void rescanForPixels(const displayParameters &, const std::vector<int64> &, const std::vector<int64> &, const clipRect &, std::vector<int> &);
+
+// Occupancy counts of the samples on a grid over the view they were fitted
+// to, at PYRAMID_LEVELS resolutions. A view is drawn from the coarsest level
+// whose cells are no larger than a pixel, so the work depends on the number
+// of pixels rather than samples. Zoomed in past the finest level, only the
+// samples of the finest cells in view are drawn (cell_offsets/cell_entries
+// list them by cell). Queries go through the same cells, so a selection
+// finds the samples of exactly the dots drawn inside it.
+class lod_pyramid {
+    public:
+         lod_pyramid();
+         void clear();
+         bool isBuilt();
+         void build(const displayParameters &, const std::vector<int64> &, const std::vector<int64> &);
+         void collect(const displayParameters &, const std::vector<int64> &, const std::vector<int64> &,
+                      std::vector<ldouble> &, std::vector<ldouble> &);
+         void query(const displayParameters &, const std::vector<int64> &, const std::vector<int64> &,
+                    const clipRect &, std::vector<int> &);
+    private:
+         int getCell(ldouble, ldouble, int);
+         int getLevel(const displayParameters &, bool &);
+         void getVisibleCells(const displayParameters &, int, int &, int &, int &, int &);
+         std::vector<std::vector<unsigned int> > levels;
+         std::vector<unsigned int> cell_offsets;
+         std::vector<unsigned int> cell_entries;
+         ldouble dom_minx, dom_miny;
+         ldouble dom_w, dom_h;
+         bool built;
+};
+
 class visualizer : public Fl_Box {
     public:
          visualizer(int,int,int,int);
          int getClocx();
          int getClocy();
-         int getXZeroOffset();
-         int getYZeroOffset();
          int getNumValues();
          int handle(int);
          bool FPEOccurred();
@@ -233,151 +666,195 @@ class visualizer : public Fl_Box {
          evaluator *getYEvaluator();
          void resetInvalidIndices();
          void updateMinMaxValues();
+         void renderPlot(framebuffer &, const displayParameters &);
+         render_mode_value getRenderMode();
+         bool usePyramid(const displayParameters &);
+         void renderImage();
+         void invalidatePlot();
+         void buildIndex();
+         void buildPyramid();
+         void setSweepStart(int64);
+         void zoomAt(int, int, ldouble);
+         void pan(int, int);
+         void queryT(const clipRect &, std::vector<int64> &);
+         bool exportImage(int, int, const std::string &);
+         void resize(int,int,int,int);
          void draw();
     private:
          evaluator Xevaluator;
          evaluator Yevaluator;
+         framebuffer fb;
+         framebuffer image_fb;
+         displayParameters fb_view;
+         render_mode_value fb_mode;
+         bool fb_valid;
+         tile_rasterizer rasterizer;
+         std::vector<ldouble> sample_px;
+         std::vector<ldouble> sample_py;
+         t_index tindex;
+         lod_pyramid pyramid;
          std::string cursor_str;
          displayParameters dparams;
-         int box_locx, box_locy;
          int num_values;
+         int64 sweep_first;
+         int sel_x0, sel_y0, sel_x1, sel_y1;
+         int pan_x, pan_y;
+         bool selecting;
+         bool panning;
          bool show_tooltip;
 };
 
-visualizer::visualizer(int x,int y,int w,int h) : Fl_Box(x,y,w,h,0) {
-
-    dparams.vis_maxx = (ldouble)w;
-    dparams.vis_minx = 0.0;
-
-    dparams.vis_maxy = (ldouble)h;
-    dparams.vis_miny = 0.0;
-
-    dparams.vis_diffx = (ldouble)w;
-    dparams.vis_diffy = (ldouble)h;
-
-    dparams.maxx = (ldouble)w/2.0;
-    dparams.minx = -1.0 * dparams.maxx;
-
-    dparams.maxy = (ldouble)h/2.0;
-    dparams.miny = -1.0 * dparams.maxy;
-
-    dparams.incx = 1;
-
-    box_locx = x;
-    box_locy = y;
-
-    show_tooltip = false;
-
-    cursor_str = "";
-
-    Xevaluator.init(temp_global_strx);
-    Yevaluator.init(temp_global_stry);
+void showQueryResults(const std::vector<int64> &);
 
-    num_values = 0;
+framebuffer::framebuffer() {
+     width = height = 0;
 }
 
-int visualizer::getYZeroOffset() {
-     return h()/2;
+void framebuffer::resize(int w, int h) {
+     width = w;
+     height = h;
+     pixels.resize((size_t)w*(size_t)h*3);
 }
 
-int visualizer::getXZeroOffset() {
-     return w()/2;
+void framebuffer::clear(unsigned int rgb) {
+     for (int i = 0; i < width*height; ++i)
+          setPixel(i % width, i / width, rgb);
 }
 
-int visualizer::getNumValues() {
-     return (Yevaluator.getNumValues() == Xevaluator.getNumValues() ? Yevaluator.getNumValues() : 0);
+void framebuffer::setPixel(int x, int y, unsigned int rgb) {
+     unsigned char *px = &pixels[((size_t)y*(size_t)width + (size_t)x)*3];
+     px[0] = (unsigned char)(rgb >> 16);
+     px[1] = (unsigned char)(rgb >> 8);
+     px[2] = (unsigned char)rgb;
 }
 
-bool visualizer::UDFOccurred() {
-     return Xevaluator.UDFOccurred() ||
-            Yevaluator.UDFOccurred();
+void framebuffer::fillRect(const clipRect &r, unsigned int rgb) {
+     for (int y = r.miny; y <= r.maxy; ++y)
+          for (int x = r.minx; x <= r.maxx; ++x)
+               setPixel(x, y, rgb);
 }
 
-bool visualizer::FPEOccurred() {
-     return Xevaluator.FPEOccurred() ||
-            Yevaluator.FPEOccurred();
+int framebuffer::getWidth() {
+     return width;
 }
 
-bool visualizer::parseErrorOccurred() {
-     return Xevaluator.currentExpressionBad() ||
-            Yevaluator.currentExpressionBad();
+int framebuffer::getHeight() {
+     return height;
 }
 
-bool visualizer::evaluationErrorOccurred() {
-     return FPEOccurred() || UDFOccurred();
+clipRect framebuffer::getBounds() {
+     clipRect r = {0, 0, width - 1, height - 1};
+     return r;
 }
 
-void visualizer::resetInvalidIndices() {
-     Xevaluator.resetInvalidIndices();
-     Yevaluator.resetInvalidIndices();
+const unsigned char *framebuffer::getPixels() {
+     return &pixels[0];
 }
 
-void visualizer::draw() {
-     num_values = getNumValues();
-
-     fl_draw_box(FL_FLAT_BOX,x(),y(),w(),h(),FL_BLACK);
-
-     fl_color(FL_WHITE);
-     fl_font(FL_HELVETICA,16);
+bool framebuffer::writePPM(const std::string &path) {
+     std::ofstream out(path.c_str(), std::ios::binary);
+     if (!out)
+         return false;
+     out << "P6\n" << width << " " << height << "\n255\n";
+     out.write((const char *)&pixels[0], (std::streamsize)pixels.size());
+     return (bool)out;
+}
 
-     int offsetx, offsety;
-     int tooltip_width = 0;
+// Liang-Barsky against the inclusive rectangle r; false when the segment
+// misses it entirely (this includes both endpoints outside on one side)
+bool clipSegment(ldouble &x0, ldouble &y0, ldouble &x1, ldouble &y1, const clipRect &r) {
+     const ldouble dx = x1 - x0;
+     const ldouble dy = y1 - y0;
+     const ldouble p[4] = {-dx, dx, -dy, dy};
+     const ldouble q[4] = {x0 - (ldouble)r.minx, (ldouble)r.maxx - x0, y0 - (ldouble)r.miny, (ldouble)r.maxy - y0};
+
+     ldouble u0 = 0.0, u1 = 1.0;
+
+     for (int i = 0; i < 4; ++i) {
+          if (p[i] == 0.0) {
+              if (q[i] < 0.0)
+                  return false;
+              continue;
+          }
+          const ldouble u = q[i] / p[i];
+          if (p[i] < 0.0) {
+              if (u > u1)
+                  return false;
+              u0 = std::max(u0, u);
+          }
+          else {
+              if (u < u0)
+                  return false;
+              u1 = std::min(u1, u);
+          }
+     }
 
-     int64 yy,xx;
+     const ldouble sx = x0, sy = y0;
+     x0 = sx + u0*dx;
+     y0 = sy + u0*dy;
+     x1 = sx + u1*dx;
+     y1 = sy + u1*dy;
+     return true;
+}
 
-     if (!parseErrorOccurred()) {
-         if (!evaluationErrorOccurred()) {
+// integer endpoints {x0,y0,x1,y1} of the part of a segment inside viewport
+bool clipSegmentToPixels(ldouble x0, ldouble y0, ldouble x1, ldouble y1, const clipRect &viewport, int64 *ends) {
+     if (!clipSegment(x0, y0, x1, y1, viewport))
+         return false;
 
-             fl_draw_box(FL_FLAT_BOX,x(),y() + getYZeroOffset(),w(),1,FL_DARK3);
-             fl_draw_box(FL_FLAT_BOX,x() + getXZeroOffset(),y(),1,h(),FL_DARK3);
+     ends[0] = (int64)std::floor(x0 + 0.5);
+     ends[1] = (int64)std::floor(y0 + 0.5);
+     ends[2] = (int64)std::floor(x1 + 0.5);
+     ends[3] = (int64)std::floor(y1 + 0.5);
+     return true;
+}
 
-             for (int p = 0; p < num_values; p += dparams.incx) {
-                  xx = Xevaluator.getValue(p);
-                  yy = Yevaluator.getValue(p);
-                  offsetx = (int)(dparams.vis_diffx*((ldouble)xx - dparams.minx)/(dparams.maxx - dparams.minx));
-                  offsety = h() - (int)(dparams.vis_diffy*((ldouble)yy - dparams.miny)/(dparams.maxy - dparams.miny));
+// Values are kept as int64 whatever the width. uint64 results above
+// LLONG_MAX only plot where they belong when read back as unsigned.
+ldouble plotValue(const displayParameters &dp, int64 v) {
+     return dp.unsigned_values ? (ldouble)(uint64_t)v : (ldouble)v;
+}
 
-                  fl_draw_box(FL_FLAT_BOX,offsetx + box_locx,offsety + box_locy,1,1,FL_RED);
-              }
-         }
-         else {
-              if (FPEOccurred())
-                  fl_draw("Floating Point Exception",x()+8,y()+24);
-              else
-                  fl_draw("Undefined Behavior Triggered (shift)",x()+8,y()+24);
-         }
+// smallest and largest value in the order of the evaluation type
+void valueRange(const std::vector<int64> &values, bool unsigned_values, ldouble &lo, ldouble &hi) {
+     if (unsigned_values) {
+         lo = (ldouble)(uint64_t)*std::min_element(values.begin(), values.end(),
+                                 [](int64 a, int64 b) { return (uint64_t)a < (uint64_t)b; });
+         hi = (ldouble)(uint64_t)*std::max_element(values.begin(), values.end(),
+                                 [](int64 a, int64 b) { return (uint64_t)a < (uint64_t)b; });
      }
      else {
-          fl_draw("Parse Error",x()+8,y()+24);
+         lo = (ldouble)*std::min_element(values.begin(), values.end());
+         hi = (ldouble)*std::max_element(values.begin(), values.end());
      }
+}
 
-     if (show_tooltip) {
-          tooltip_width = (int)cursor_str.size()*6;
-          fl_draw_box(FL_EMBOSSED_BOX,getClocx()-tooltip_width,getClocy() - 12,tooltip_width,12,FL_WHITE);
-          fl_color(FL_BLACK);
-          fl_font(FL_HELVETICA,10);
-          fl_draw(&cursor_str[0],getClocx()-tooltip_width+4,getClocy()-2);
-     }
+// position of a sample in canvas pixels, y pointing down; ldouble keeps
+// samples far outside the view exact enough for clipping
+void mapSample(const displayParameters &dp, ldouble xx, ldouble yy, ldouble &px, ldouble &py) {
+     px = dp.vis_diffx*(xx - dp.minx)/(dp.maxx - dp.minx);
+     py = dp.vis_diffy - dp.vis_diffy*(yy - dp.miny)/(dp.maxy - dp.miny);
 }
 
-void visualizer::updateMinMaxValues() {
-     auto maxy_value = Yevaluator.queryMaxValue();
-     auto miny_value = Yevaluator.queryMinValue();
-     auto maxx_value = Xevaluator.queryMaxValue();
-     auto minx_value = Xevaluator.queryMinValue();
+// symmetric axis ranges around 0 that hold the given extremes, within the
+// MIN/MAX bounds (raised to the uint64 range for unsigned values); the vis_*
+// fields are left alone
+void fitDisplayParameters(displayParameters &dparams, ldouble minx_value, ldouble maxx_value, ldouble miny_value, ldouble maxy_value) {
+     const ldouble maxy_upper = dparams.unsigned_values ? (ldouble)ULLONG_MAX : (ldouble)MAXY_UPPER_BOUND;
+     const ldouble maxx_upper = dparams.unsigned_values ? (ldouble)ULLONG_MAX : (ldouble)MAXX_UPPER_BOUND;
 
-     dparams.maxy = (ldouble)(maxy_value <= MAXY_UPPER_BOUND ? maxy_value : MAXY_UPPER_BOUND);
+     dparams.maxy = std::min(maxy_value, maxy_upper);
      dparams.maxy = (dparams.maxy >= (ldouble)MAXY_LOWER_BOUND) ? dparams.maxy : (ldouble)MAXY_LOWER_BOUND;
-     dparams.miny = (ldouble)(miny_value >= MINY_LOWER_BOUND ? miny_value : MINY_LOWER_BOUND);
+     dparams.miny = std::max(miny_value, (ldouble)MINY_LOWER_BOUND);
      dparams.miny = (dparams.miny <= (ldouble)MINY_UPPER_BOUND) ? dparams.miny : (ldouble)MINY_UPPER_BOUND;
      if (std::abs(dparams.maxy) > std::abs(dparams.miny))
          dparams.miny = -1.0*dparams.maxy;
      else
          dparams.maxy = -1.0*dparams.miny;
 
-     dparams.maxx = (ldouble)(maxx_value <= MAXX_UPPER_BOUND ? maxx_value : MAXX_UPPER_BOUND);
+     dparams.maxx = std::min(maxx_value, maxx_upper);
      dparams.maxx = (dparams.maxx >= (ldouble)MAXX_LOWER_BOUND) ? dparams.maxx : (ldouble)MAXX_LOWER_BOUND;
-     dparams.minx = (ldouble)(minx_value >= MINX_LOWER_BOUND ? minx_value : MINX_LOWER_BOUND);
+     dparams.minx = std::max(minx_value, (ldouble)MINX_LOWER_BOUND);
      dparams.minx = (dparams.minx <= (ldouble)MINX_UPPER_BOUND) ? dparams.minx : (ldouble)MINX_UPPER_BOUND;
      if (std::abs(dparams.maxx) > std::abs(dparams.minx))
          dparams.minx = -1.0*dparams.maxx;
@@ -385,473 +862,2660 @@ void visualizer::updateMinMaxValues() {
          dparams.maxx = -1.0*dparams.minx;
 }
 
-int visualizer::getClocx() {
-     return Fl::event_x();
+// a data coordinate as an integer, unsigned past LLONG_MAX
+std::string formatCoordinate(ldouble v) {
+     if (v >= (ldouble)ULLONG_MAX)
+         return std::to_string(ULLONG_MAX);
+     if (v > (ldouble)LLONG_MAX)
+         return std::to_string((unsigned long long)v);
+     if (v < (ldouble)LLONG_MIN)
+         return std::to_string(LLONG_MIN);
+     return std::to_string((int64)v);
 }
 
-int visualizer::getClocy() {
-     return Fl::event_y();
+// pixel a position falls on in points mode (truncated like the original
+// fl_draw_box plotting), false when it is off the canvas
+bool pixelOfPosition(ldouble px, ldouble py, int width, int height, int &ox, int &oy) {
+     if (px < 0.0 || py < 0.0 || px >= (ldouble)width || py >= (ldouble)height)
+         return false;
+     ox = (int)px;
+     oy = height - (int)((ldouble)height - py);
+     return oy < height;
 }
 
-int visualizer::handle(int e) {
-   switch (e) {
-       case(FL_LEAVE): {
-            show_tooltip = false;
-            redraw();
-            return 1;
-       }
-       case(FL_ENTER): {
-            show_tooltip = true;
-            redraw();
-            return 1;
-       }
-       case(FL_MOVE): {
-            std::string clocx_str = std::to_string((int64)((ldouble)((getClocx()-x())*(dparams.maxx - dparams.minx)/dparams.vis_diffx) + dparams.minx));
-            std::string clocy_str = std::to_string((int64)((ldouble)((h() - getClocy() + y())*(dparams.maxy - dparams.miny)/dparams.vis_diffy) + dparams.miny));
-            cursor_str = "(" + clocx_str + "," + clocy_str + ")";
-            show_tooltip = true;
-            redraw();
-            return 1;
-       }
-       default:
-            break;
-   }
-   return(Fl_Box::handle(e));
+bool sameView(const displayParameters &a, const displayParameters &b) {
+     return a.minx == b.minx && a.maxx == b.maxx &&
+            a.miny == b.miny && a.maxy == b.maxy &&
+            a.vis_diffx == b.vis_diffx && a.vis_diffy == b.vis_diffy &&
+            a.incx == b.incx && a.unsigned_values == b.unsigned_values;
 }
 
-evaluator *visualizer::getXEvaluator() {
-   return &Xevaluator;
+thread_pool::thread_pool(int num_threads, int queue_limit) {
+     max_queued = queue_limit;
+     stopping = false;
+     for (int i = 0; i < num_threads; ++i)
+          workers.push_back(std::thread(&thread_pool::workerLoop, this));
 }
 
-evaluator *visualizer::getYEvaluator() {
-   return &Yevaluator;
+thread_pool::~thread_pool() {
+     {
+          std::unique_lock<std::mutex> lock(mtx);
+          stopping = true;
+     }
+     task_cv.notify_all();
+     space_cv.notify_all();
+     for (auto & w: workers)
+          w.join();
 }
 
-evaluator::evaluator() {
+int thread_pool::getNumThreads() {
+     return (int)workers.size();
 }
 
-int64 evaluator::getValue(int i) {
-   return values[i];
+void thread_pool::submit(std::function<void()> task) {
+     std::unique_lock<std::mutex> lock(mtx);
+     space_cv.wait(lock, [this]() { return stopping || (int)tasks.size() < max_queued; });
+     if (stopping)
+         return;
+     tasks.push_back(std::move(task));
+     task_cv.notify_one();
 }
 
-int64 evaluator::queryMinValue() {
-   return *(std::min_element(values.begin(), values.end()));
+void thread_pool::workerLoop() {
+     for (;;) {
+          std::function<void()> task;
+          {
+               std::unique_lock<std::mutex> lock(mtx);
+               task_cv.wait(lock, [this]() { return stopping || !tasks.empty(); });
+               if (stopping && tasks.empty())
+                   return;
+               task = std::move(tasks.front());
+               tasks.pop_front();
+          }
+          space_cv.notify_one();
+          task();
+     }
 }
 
-int64 evaluator::queryMaxValue() {
-   return *(std::max_element(values.begin(), values.end()));
+// The caller claims indices too, so this finishes even when every worker is
+// busy (e.g. when called from inside a pool task). Helpers that start late
+// find nothing left to claim; the shared state outlives the call for them.
+void thread_pool::parallelFor(int n, const std::function<void(int)> &fn) {
+     struct loop_state {
+          std::atomic<int> next;
+          std::atomic<int> done;
+          std::mutex mtx;
+          std::condition_variable cv;
+     };
+
+     if (n <= 0)
+         return;
+
+     std::shared_ptr<loop_state> state = std::make_shared<loop_state>();
+     state->next = 0;
+     state->done = 0;
+
+     const std::function<void(int)> *body = &fn;
+
+     auto run = [state, body, n]() {
+          for (int i = state->next++; i < n; i = state->next++) {
+               (*body)(i);
+               if (++state->done == n) {
+                   std::unique_lock<std::mutex> lock(state->mtx);
+                   state->cv.notify_all();
+               }
+          }
+     };
+
+     const int helpers = std::min(n - 1, getNumThreads());
+     for (int i = 0; i < helpers; ++i) {
+          std::unique_lock<std::mutex> lock(mtx);
+          if ((int)tasks.size() >= max_queued)
+              break;
+          tasks.push_back(run);
+          task_cv.notify_one();
+     }
+
+     run();
+
+     std::unique_lock<std::mutex> lock(state->mtx);
+     state->cv.wait(lock, [&state, n]() { return state->done == n; });
 }
 
-void evaluator::init(std::string init_str) {
-    fpe_index = udf_index = VALID_CONSTANT_IND;
-    bad_expression = false;
-    expression_str = init_str;
+thread_pool &getThreadPool() {
+     static thread_pool pool((int)std::max(1u, std::thread::hardware_concurrency()), 1024);
+     return pool;
 }
 
-void evaluator::separateStringTokens(std::string str) {
+tile_rasterizer::tile_rasterizer() {
+     tiles_x = tiles_y = 0;
+}
 
-    tokens.resize(0);
-    parse_results.resize(0);
-    expression_vec.resize(0);
+// px/py are sample positions from mapSample, zerox/zeroy the axis pixels
+void tile_rasterizer::render(framebuffer &fb, const std::vector<ldouble> &px, const std::vector<ldouble> &py,
+                             render_mode_value mode, int zerox, int zeroy) {
+     bounds = fb.getBounds();
+     tiles_x = (fb.getWidth() + TILE_SIZE - 1) / TILE_SIZE;
+     tiles_y = (fb.getHeight() + TILE_SIZE - 1) / TILE_SIZE;
 
-    expression_str = str;
+     if (mode == RENDER_MODE_LINES)
+         binSegments(px, py);
+     else
+         binPoints(px, py);
 
-    bad_expression = checkInvalidChars() || (int)expression_str.size() == 0;
+     getThreadPool().parallelFor(tiles_x*tiles_y, [&](int tile) {
+          renderTile(fb, tile, px, py, mode, zerox, zeroy);
+     });
 
-    if (bad_expression)
-        return;
+     if (mode == RENDER_MODE_LINES && !long_segments.empty())
+         renderLongSegments(fb, px, py);
+}
 
-    expression_str += global_delim;
+// counting sort of sample indices by tile, -1 marks samples off the canvas
+void tile_rasterizer::binPoints(const std::vector<ldouble> &px, const std::vector<ldouble> &py) {
+     const int n = (int)px.size();
+     int ox, oy;
 
-    auto curr_iter = expression_str.begin();
-    auto base_iter = expression_str.begin();
-    auto next_iter = expression_str.begin();
+     sample_tile.resize(n);
+     bin_offsets.assign(tiles_x*tiles_y + 1, 0);
 
-    for (;; curr_iter++) {
-         next_iter++;
+     for (int i = 0; i < n; ++i) {
+          sample_tile[i] = -1;
+          if (!pixelOfPosition(px[i], py[i], bounds.maxx + 1, bounds.maxy + 1, ox, oy))
+              continue;
+          sample_tile[i] = (oy / TILE_SIZE)*tiles_x + ox / TILE_SIZE;
+          bin_offsets[sample_tile[i] + 1]++;
+     }
 
-         auto curr_char = *curr_iter;
-         auto base_char = *base_iter;
-         auto next_char = *next_iter;
+     for (int t = 0; t < tiles_x*tiles_y; ++t)
+          bin_offsets[t + 1] += bin_offsets[t];
 
-         auto base_digit = isHexDigit(base_char);
-         auto next_digit = isHexDigit(next_char);
+     bin_entries.resize(bin_offsets[tiles_x*tiles_y]);
+     std::vector<size_t> fill(bin_offsets.begin(), bin_offsets.end() - 1);
 
-         bool curr_shift = ((curr_char == '>' || curr_char == '<') && (curr_char == next_char));
+     for (int i = 0; i < n; ++i)
+          if (sample_tile[i] >= 0)
+              bin_entries[fill[sample_tile[i]]++] = i;
+}
 
-         if (!base_digit || !next_digit) {
-             if (!curr_shift) {
-                 expression_vec.push_back(std::string(base_iter,curr_iter+1));
-             }
-             else {
-                 expression_vec.push_back(std::string(curr_iter,next_iter+1));
-                 curr_iter++;
-                 next_iter++;
-             }
-             base_iter = next_iter;
-         }
+// tiles crossed by segment i, stored in tiles up to SEGMENT_MAX_BINNED_TILES
+// (the count goes on past that); 0 when the segment misses the canvas
+int tile_rasterizer::getSegmentTiles(const std::vector<ldouble> &px, const std::vector<ldouble> &py, int i, int *tiles) {
+     int64 ends[4];
+     int count = 0;
+
+     if (clipSegmentToPixels(px[i], py[i], px[i+1], py[i+1], bounds, ends))
+         forEachSegmentTile(ends, [&count, tiles](int tile) {
+              if (count < SEGMENT_MAX_BINNED_TILES)
+                  tiles[count] = tile;
+              count++;
+         });
+     return count;
+}
 
-         if (*next_iter == global_delim)
-             break;
-    }
+// Segment i joins samples i and i+1. A short segment goes into every tile it
+// crosses, a long one into long_segments, which keeps the bins within
+// SEGMENT_MAX_BINNED_TILES entries per segment.
+void tile_rasterizer::binSegments(const std::vector<ldouble> &px, const std::vector<ldouble> &py) {
+     const int n = (int)px.size() - 1;
+     int tiles[SEGMENT_MAX_BINNED_TILES];
+
+     bin_offsets.assign(tiles_x*tiles_y + 1, 0);
+     long_segments.resize(0);
+
+     for (int i = 0; i < n; ++i) {
+          const int count = getSegmentTiles(px, py, i, tiles);
+          if (count > SEGMENT_MAX_BINNED_TILES) {
+              long_segments.push_back(i);
+              continue;
+          }
+          for (int k = 0; k < count; ++k)
+               bin_offsets[tiles[k] + 1]++;
+     }
 
-    expression_vec.erase(std::remove(expression_vec.begin(), expression_vec.end(), " "), expression_vec.end());
+     for (int t = 0; t < tiles_x*tiles_y; ++t)
+          bin_offsets[t + 1] += bin_offsets[t];
 
-    for (auto i = 0; i < (int)expression_vec.size(); ++i) {
-         if (i > 0) {
-             if (expression_vec[i] == "-" && expression_vec[i-1] == "-") {
-                 bad_expression = true;
-                 return;
-             }
-         }
-    }
+     bin_entries.resize(bin_offsets[tiles_x*tiles_y]);
+     std::vector<size_t> fill(bin_offsets.begin(), bin_offsets.end() - 1);
 
-    for (auto i = 0; i < (int)expression_vec.size(); ++i) {
-         if (expression_vec[i] == "-") {
-             if (i == 0) {
-                 expression_vec[i] = "u-";
-             }
-             else if (isPotentiallyBeforeUnaryMinus(expression_vec[i-1][0])) {
-                 expression_vec[i] = "u-";
-             }
-         }
-    }
+     for (int i = 0; i < n; ++i) {
+          const int count = getSegmentTiles(px, py, i, tiles);
+          if (count > SEGMENT_MAX_BINNED_TILES)
+              continue;
+          for (int k = 0; k < count; ++k)
+               bin_entries[fill[tiles[k]]++] = i;
+     }
+}
 
-    expression_str = "";
+// Runs after the tiles are done. Each worker owns a band of rows and draws
+// the part of every long segment inside it, so the cost per long segment is
+// one clip per band plus its pixels.
+void tile_rasterizer::renderLongSegments(framebuffer &fb, const std::vector<ldouble> &px, const std::vector<ldouble> &py) {
+     const int bands = std::min(getThreadPool().getNumThreads() + 1, bounds.maxy + 1);
+     const int rows = (bounds.maxy + 1 + bands - 1) / bands;
 
-    for (const auto & x: expression_vec) {
-         expression_str += x;
+     getThreadPool().parallelFor(bands, [&](int b) {
+          const clipRect band = {bounds.minx, b*rows, bounds.maxx, std::min((b + 1)*rows, bounds.maxy + 1) - 1};
+          if (band.miny > band.maxy)
+              return;
+          for (const auto & i: long_segments)
+               rasterizeSegment(fb, px[i], py[i], px[i+1], py[i+1], bounds, band, CURVE_RGB);
+     });
+}
+
+// Walks the clipped segment one band of tiles at a time along its major axis
+// and reports the tiles its minor coordinate spans within that band, using
+// the same stepping as rasterizeSegment.
+template <typename F>
+void tile_rasterizer::forEachSegmentTile(const int64 *ends, F fn) {
+     const bool xmajor = std::abs(ends[2] - ends[0]) >= std::abs(ends[3] - ends[1]);
+
+     const int64 a0 = xmajor ? ends[0] : ends[1], a1 = xmajor ? ends[2] : ends[3];
+     const int64 b0 = xmajor ? ends[1] : ends[0], b1 = xmajor ? ends[3] : ends[2];
+
+     const int64 da = std::abs(a1 - a0), db = std::abs(b1 - b0);
+     const int64 sa = (a1 >= a0) ? 1 : -1, sb = (b1 >= b0) ? 1 : -1;
+     const int64 den = 2*std::max(da, 1LL);
+
+     int64 k = 0;
+     while (k <= da) {
+          const int64 a = a0 + sa*k;
+          const int64 band = a / TILE_SIZE;
+          const int64 band_end = sa > 0 ? (band + 1)*TILE_SIZE - 1 : band*TILE_SIZE;
+          const int64 kend = std::min(da, std::abs(band_end - a0));
+
+          const int64 bstart = b0 + sb*((2*k*db + da) / den);
+          const int64 bend = b0 + sb*((2*kend*db + da) / den);
+          const int64 cmin = std::min(bstart, bend) / TILE_SIZE, cmax = std::max(bstart, bend) / TILE_SIZE;
+
+          for (int64 c = cmin; c <= cmax; ++c)
+               fn(xmajor ? (int)(c*tiles_x + band) : (int)(band*tiles_x + c));
+
+          k = kend + 1;
+     }
+}
+
+void tile_rasterizer::renderTile(framebuffer &fb, int tile, const std::vector<ldouble> &px, const std::vector<ldouble> &py,
+                                 render_mode_value mode, int zerox, int zeroy) {
+     const int tx = tile % tiles_x, ty = tile / tiles_x;
+     const clipRect r = {tx*TILE_SIZE, ty*TILE_SIZE,
+                         std::min((tx + 1)*TILE_SIZE, bounds.maxx + 1) - 1,
+                         std::min((ty + 1)*TILE_SIZE, bounds.maxy + 1) - 1};
+
+     fb.fillRect(r, BACKGROUND_RGB);
+
+     if (zeroy >= r.miny && zeroy <= r.maxy)
+         for (int x = r.minx; x <= r.maxx; ++x)
+              fb.setPixel(x, zeroy, AXIS_RGB);
+     if (zerox >= r.minx && zerox <= r.maxx)
+         for (int y = r.miny; y <= r.maxy; ++y)
+              fb.setPixel(zerox, y, AXIS_RGB);
+
+     int ox, oy;
+
+     for (size_t e = bin_offsets[tile]; e < bin_offsets[tile + 1]; ++e) {
+          const int i = bin_entries[e];
+          if (mode == RENDER_MODE_LINES)
+              rasterizeSegment(fb, px[i], py[i], px[i+1], py[i+1], bounds, r, CURVE_RGB);
+          else if (pixelOfPosition(px[i], py[i], bounds.maxx + 1, bounds.maxy + 1, ox, oy))
+              fb.setPixel(ox, oy, CURVE_RGB);
+     }
+}
+
+// The segment is clipped to the viewport first so its integer endpoints are
+// small no matter how far outside the samples were. Pixels are then walked
+// with Bresenham's error term, started at the first step inside dst so that
+// a sub-rectangle of the viewport gets exactly the pixels the full line has.
+void rasterizeSegment(framebuffer &fb, ldouble x0, ldouble y0, ldouble x1, ldouble y1,
+                      const clipRect &viewport, const clipRect &dst, unsigned int rgb) {
+     int64 ends[4];
+
+     if (!clipSegmentToPixels(x0, y0, x1, y1, viewport, ends))
+         return;
+
+     const int64 ix0 = ends[0], iy0 = ends[1];
+     const int64 ix1 = ends[2], iy1 = ends[3];
+
+     const bool xmajor = std::abs(ix1 - ix0) >= std::abs(iy1 - iy0);
+
+     // major/minor axis view of the segment and of dst
+     const int64 a0 = xmajor ? ix0 : iy0, a1 = xmajor ? ix1 : iy1;
+     const int64 b0 = xmajor ? iy0 : ix0, b1 = xmajor ? iy1 : ix1;
+     const int64 amin = xmajor ? dst.minx : dst.miny, amax = xmajor ? dst.maxx : dst.maxy;
+     const int64 bmin = xmajor ? dst.miny : dst.minx, bmax = xmajor ? dst.maxy : dst.maxx;
+
+     const int64 da = std::abs(a1 - a0), db = std::abs(b1 - b0);
+     const int64 sa = (a1 >= a0) ? 1 : -1, sb = (b1 >= b0) ? 1 : -1;
+
+     // steps k in [kmin, kmax] whose major coordinate a0 + sa*k lies in dst
+     int64 kmin = sa > 0 ? amin - a0 : a0 - amax;
+     int64 kmax = sa > 0 ? amax - a0 : a0 - amin;
+     kmin = std::max(kmin, 0LL);
+     kmax = std::min(kmax, da);
+
+     if (kmin > kmax)
+         return;
+
+     // minor offset after k steps is (2*k*db + da) / (2*da)
+     const int64 den = 2*std::max(da, 1LL);
+     int64 num = 2*kmin*db + da;
+     int64 boff = num / den;
+     int64 rem = num % den;
+
+     for (int64 k = kmin; k <= kmax; ++k) {
+          const int64 a = a0 + sa*k;
+          const int64 b = b0 + sb*boff;
+          if (b >= bmin && b <= bmax) {
+              if (xmajor)
+                  fb.setPixel((int)a, (int)b, rgb);
+              else
+                  fb.setPixel((int)b, (int)a, rgb);
+          }
+          rem += 2*db;
+          if (rem >= den) {
+              rem -= den;
+              boff++;
+          }
+     }
+}
+
+t_index::t_index() {
+     width = 0;
+     valid = false;
+}
+
+void t_index::clear() {
+     pixels.resize(0);
+     offsets.resize(0);
+     entries.resize(0);
+     valid = false;
+}
+
+bool t_index::isValidFor(const displayParameters &dp) {
+     return valid && sameView(view, dp);
+}
+
+// counting sort of samples by pixel, then the empty pixels are squeezed out
+void t_index::build(const displayParameters &dp, const std::vector<int64> &xs, const std::vector<int64> &ys) {
+     clear();
+
+     const int n = (int)std::min(xs.size(), ys.size());
+     const int w = (int)dp.vis_diffx, h = (int)dp.vis_diffy;
+
+     if (n > INDEX_MAX_SAMPLES || w <= 0 || h <= 0)
+         return;
+
+     std::vector<unsigned int> counts((size_t)w*(size_t)h + 1, 0);
+     std::vector<int> sample_pixel(n, -1);
+     ldouble px, py;
+     int ox, oy;
+
+     for (int i = 0; i < n; i += dp.incx) {
+          mapSample(dp, plotValue(dp, xs[i]), plotValue(dp, ys[i]), px, py);
+          if (!pixelOfPosition(px, py, w, h, ox, oy))
+              continue;
+          sample_pixel[i] = oy*w + ox;
+          counts[sample_pixel[i] + 1]++;
+     }
+
+     for (size_t p = 0; p + 1 < counts.size(); ++p) {
+          if (counts[p + 1] > 0) {
+              pixels.push_back((unsigned int)p);
+              offsets.push_back((unsigned int)entries.size());
+              entries.resize(entries.size() + counts[p + 1]);
+          }
+     }
+     offsets.push_back((unsigned int)entries.size());
+
+     // counts[p] becomes the fill position of pixel p
+     for (size_t k = 0; k < pixels.size(); ++k)
+          counts[pixels[k]] = offsets[k];
+
+     for (int i = 0; i < n; i += dp.incx)
+          if (sample_pixel[i] >= 0)
+              entries[counts[sample_pixel[i]]++] = (unsigned int)i;
+
+     view = dp;
+     width = w;
+     valid = true;
+}
+
+// sample indices of every pixel in r, in increasing order
+void t_index::query(const clipRect &r, std::vector<int> &out) {
+     for (int y = r.miny; y <= r.maxy; ++y) {
+          auto lo = std::lower_bound(pixels.begin(), pixels.end(), (unsigned int)(y*width + r.minx));
+          auto hi = std::upper_bound(lo, pixels.end(), (unsigned int)(y*width + r.maxx));
+          for (auto it = lo; it != hi; ++it) {
+               const size_t k = (size_t)(it - pixels.begin());
+               out.insert(out.end(), entries.begin() + offsets[k], entries.begin() + offsets[k + 1]);
+          }
+     }
+     std::sort(out.begin(), out.end());
+}
+
+// fallback when there is no index: maps every sample again, chunks of
+// samples are filtered in parallel and the hits concatenated in order
+void rescanForPixels(const displayParameters &dp, const std::vector<int64> &xs, const std::vector<int64> &ys,
+                     const clipRect &r, std::vector<int> &out) {
+     const int n = (int)std::min(xs.size(), ys.size());
+     const int chunks = (n + RESCAN_CHUNK_SAMPLES - 1) / RESCAN_CHUNK_SAMPLES;
+     const int w = (int)dp.vis_diffx, h = (int)dp.vis_diffy;
+
+     std::vector<std::vector<int> > hits(chunks);
+
+     getThreadPool().parallelFor(chunks, [&](int c) {
+          const int last = std::min(n, (c + 1)*RESCAN_CHUNK_SAMPLES);
+          ldouble px, py;
+          int ox, oy;
+          for (int i = c*RESCAN_CHUNK_SAMPLES; i < last; ++i) {
+               if (i % dp.incx != 0)
+                   continue;
+               mapSample(dp, plotValue(dp, xs[i]), plotValue(dp, ys[i]), px, py);
+               if (pixelOfPosition(px, py, w, h, ox, oy) &&
+                   ox >= r.minx && ox <= r.maxx && oy >= r.miny && oy <= r.maxy)
+                   hits[c].push_back(i);
+          }
+     });
+
+     for (const auto & h: hits)
+          out.insert(out.end(), h.begin(), h.end());
+}
+
+lod_pyramid::lod_pyramid() {
+     dom_minx = dom_miny = 0.0;
+     dom_w = dom_h = 1.0;
+     built = false;
+}
+
+void lod_pyramid::clear() {
+     levels.clear();
+     cell_offsets.clear();
+     cell_entries.clear();
+     built = false;
+}
+
+bool lod_pyramid::isBuilt() {
+     return built;
+}
+
+// cell of a data point at the given level, -1 outside the grid
+int lod_pyramid::getCell(ldouble x, ldouble y, int level) {
+     const int n = 1 << level;
+     const ldouble cx = std::floor((x - dom_minx)/dom_w*(ldouble)n);
+     const ldouble cy = std::floor((y - dom_miny)/dom_h*(ldouble)n);
+     if (cx < 0.0 || cy < 0.0 || cx > (ldouble)n || cy > (ldouble)n)
+         return -1;
+     // the maximum edge of the grid belongs to the last cell
+     return std::min((int)cy, n - 1)*n + std::min((int)cx, n - 1);
+}
+
+// counts at the finest level come from the samples, each coarser level
+// sums 2x2 cells of the one below
+void lod_pyramid::build(const displayParameters &dp, const std::vector<int64> &xs, const std::vector<int64> &ys) {
+     clear();
+
+     const int n = (int)std::min(xs.size(), ys.size());
+     const int finest = PYRAMID_LEVELS - 1;
+     const int side = 1 << finest;
+
+     dom_minx = dp.minx;
+     dom_miny = dp.miny;
+     dom_w = dp.maxx - dp.minx;
+     dom_h = dp.maxy - dp.miny;
+
+     levels.resize(PYRAMID_LEVELS);
+     levels[finest].assign((size_t)side*(size_t)side, 0);
+
+     // cells are computed twice rather than stored, sweeps can be huge
+     for (int i = 0; i < n; ++i) {
+          const int c = getCell(plotValue(dp, xs[i]), plotValue(dp, ys[i]), finest);
+          if (c >= 0)
+              levels[finest][c]++;
+     }
+
+     cell_offsets.assign((size_t)side*(size_t)side + 1, 0);
+     for (size_t c = 0; c < levels[finest].size(); ++c)
+          cell_offsets[c + 1] = cell_offsets[c] + levels[finest][c];
+
+     cell_entries.resize(cell_offsets.back());
+     std::vector<unsigned int> fill(cell_offsets.begin(), cell_offsets.end() - 1);
+     for (int i = 0; i < n; ++i) {
+          const int c = getCell(plotValue(dp, xs[i]), plotValue(dp, ys[i]), finest);
+          if (c >= 0)
+              cell_entries[fill[c]++] = (unsigned int)i;
+     }
+
+     for (int level = finest - 1; level >= 0; --level) {
+          const int sz = 1 << level;
+          const std::vector<unsigned int> &below = levels[level + 1];
+          levels[level].assign((size_t)sz*(size_t)sz, 0);
+          for (int cy = 0; cy < sz; ++cy)
+               for (int cx = 0; cx < sz; ++cx)
+                    levels[level][cy*sz + cx] = below[(2*cy)*(2*sz) + 2*cx] + below[(2*cy)*(2*sz) + 2*cx + 1] +
+                                                below[(2*cy + 1)*(2*sz) + 2*cx] + below[(2*cy + 1)*(2*sz) + 2*cx + 1];
+     }
+
+     built = true;
+}
+
+// inclusive cell range of the grid at the given level covered by dp's view
+void lod_pyramid::getVisibleCells(const displayParameters &dp, int level, int &cx0, int &cy0, int &cx1, int &cy1) {
+     const int n = 1 << level;
+     const ldouble cw = dom_w/(ldouble)n, ch = dom_h/(ldouble)n;
+     // clamped on both sides, a view panned far off the grid gives an empty range
+     cx0 = (int)std::min((ldouble)n, std::max((ldouble)0.0, std::floor((dp.minx - dom_minx)/cw)));
+     cy0 = (int)std::min((ldouble)n, std::max((ldouble)0.0, std::floor((dp.miny - dom_miny)/ch)));
+     cx1 = (int)std::max((ldouble)-1.0, std::min((ldouble)(n - 1), std::floor((dp.maxx - dom_minx)/cw)));
+     cy1 = (int)std::max((ldouble)-1.0, std::min((ldouble)(n - 1), std::floor((dp.maxy - dom_miny)/ch)));
+}
+
+// coarsest level whose cells are no larger than a pixel of dp; past the
+// finest level that is the finest one with use_samples set
+int lod_pyramid::getLevel(const displayParameters &dp, bool &use_samples) {
+     const ldouble pixel_w = (dp.maxx - dp.minx)/dp.vis_diffx;
+     const ldouble pixel_h = (dp.maxy - dp.miny)/dp.vis_diffy;
+
+     int level = 0;
+     while (level < PYRAMID_LEVELS &&
+            (dom_w/(ldouble)(1 << level) > pixel_w || dom_h/(ldouble)(1 << level) > pixel_h))
+            level++;
+
+     use_samples = (level == PYRAMID_LEVELS);
+     return use_samples ? PYRAMID_LEVELS - 1 : level;
+}
+
+// positions to rasterize for the view dp: occupied cell centres of the
+// coarsest level that is fine enough, or the samples themselves
+void lod_pyramid::collect(const displayParameters &dp, const std::vector<int64> &xs, const std::vector<int64> &ys,
+                          std::vector<ldouble> &px, std::vector<ldouble> &py) {
+     bool use_samples;
+     const int level = getLevel(dp, use_samples);
+     const int n = 1 << level;
+     const ldouble cw = dom_w/(ldouble)n, ch = dom_h/(ldouble)n;
+     int cx0, cy0, cx1, cy1;
+     ldouble x, y;
+
+     getVisibleCells(dp, level, cx0, cy0, cx1, cy1);
+
+     for (int cy = cy0; cy <= cy1; ++cy) {
+          for (int cx = cx0; cx <= cx1; ++cx) {
+               const int c = cy*n + cx;
+               if (levels[level][c] == 0)
+                   continue;
+               if (use_samples) {
+                   for (unsigned int e = cell_offsets[c]; e < cell_offsets[c + 1]; ++e) {
+                        mapSample(dp, plotValue(dp, xs[cell_entries[e]]), plotValue(dp, ys[cell_entries[e]]), x, y);
+                        px.push_back(x);
+                        py.push_back(y);
+                   }
+               }
+               else {
+                   mapSample(dp, dom_minx + ((ldouble)cx + 0.5)*cw, dom_miny + ((ldouble)cy + 0.5)*ch, x, y);
+                   px.push_back(x);
+                   py.push_back(y);
+               }
+          }
+     }
+}
+
+// Sample indices behind the dots collect() draws inside the canvas rectangle
+// r, in increasing order: all samples of a cell whose centre lands in r, or
+// past the finest level the samples whose own pixel is in r. Only the cells
+// under r (plus a pixel around it) are visited.
+void lod_pyramid::query(const displayParameters &dp, const std::vector<int64> &xs, const std::vector<int64> &ys,
+                        const clipRect &r, std::vector<int> &out) {
+     bool use_samples;
+     const int level = getLevel(dp, use_samples);
+     const int n = 1 << level;
+     const int side = 1 << (PYRAMID_LEVELS - 1);
+     const int shift = PYRAMID_LEVELS - 1 - level;
+     const ldouble cw = dom_w/(ldouble)n, ch = dom_h/(ldouble)n;
+     const ldouble pixel_w = (dp.maxx - dp.minx)/dp.vis_diffx;
+     const ldouble pixel_h = (dp.maxy - dp.miny)/dp.vis_diffy;
+     const int w = (int)dp.vis_diffx, h = (int)dp.vis_diffy;
+
+     displayParameters under = dp;
+     under.minx = dp.minx + (ldouble)(r.minx - 1)*pixel_w;
+     under.maxx = dp.minx + (ldouble)(r.maxx + 2)*pixel_w;
+     under.miny = dp.miny + (ldouble)(h - r.maxy - 2)*pixel_h;
+     under.maxy = dp.miny + (ldouble)(h - r.miny + 1)*pixel_h;
+
+     auto drawnInside = [&](ldouble x, ldouble y) {
+          ldouble px, py;
+          int ox, oy;
+          mapSample(dp, x, y, px, py);
+          return pixelOfPosition(px, py, w, h, ox, oy) &&
+                 ox >= r.minx && ox <= r.maxx && oy >= r.miny && oy <= r.maxy;
+     };
+
+     int cx0, cy0, cx1, cy1;
+     getVisibleCells(under, level, cx0, cy0, cx1, cy1);
+
+     for (int cy = cy0; cy <= cy1; ++cy) {
+          for (int cx = cx0; cx <= cx1; ++cx) {
+               if (levels[level][cy*n + cx] == 0)
+                   continue;
+               if (!use_samples && !drawnInside(dom_minx + ((ldouble)cx + 0.5)*cw, dom_miny + ((ldouble)cy + 0.5)*ch))
+                   continue;
+               // the finest cells making up this one
+               for (int fy = cy << shift; fy < (cy + 1) << shift; ++fy) {
+                    for (int fx = cx << shift; fx < (cx + 1) << shift; ++fx) {
+                         const int f = fy*side + fx;
+                         for (unsigned int e = cell_offsets[f]; e < cell_offsets[f + 1]; ++e) {
+                              const int i = (int)cell_entries[e];
+                              if (!use_samples || drawnInside(plotValue(dp, xs[i]), plotValue(dp, ys[i])))
+                                  out.push_back(i);
+                         }
+                    }
+               }
+          }
+     }
+     std::sort(out.begin(), out.end());
+}
+
+visualizer::visualizer(int x,int y,int w,int h) : Fl_Box(x,y,w,h,0) {
+
+    dparams.vis_maxx = (ldouble)w;
+    dparams.vis_minx = 0.0;
+
+    dparams.vis_maxy = (ldouble)h;
+    dparams.vis_miny = 0.0;
+
+    dparams.vis_diffx = (ldouble)w;
+    dparams.vis_diffy = (ldouble)h;
+
+    dparams.maxx = (ldouble)w/2.0;
+    dparams.minx = -1.0 * dparams.maxx;
+
+    dparams.maxy = (ldouble)h/2.0;
+    dparams.miny = -1.0 * dparams.maxy;
+
+    dparams.incx = 1;
+    dparams.unsigned_values = false;
+
+    show_tooltip = false;
+    selecting = false;
+    sel_x0 = sel_y0 = sel_x1 = sel_y1 = -1;
+
+    panning = false;
+    pan_x = pan_y = 0;
+
+    fb_mode = global_render_mode;
+    fb_valid = false;
+
+    sweep_first = SWEEP_FIRST_T;
+
+    cursor_str = "";
+
+    Xevaluator.init(temp_global_strx);
+    Yevaluator.init(temp_global_stry);
+
+    num_values = 0;
+}
+
+int visualizer::getNumValues() {
+     return (Yevaluator.getNumValues() == Xevaluator.getNumValues() ? Yevaluator.getNumValues() : 0);
+}
+
+bool visualizer::UDFOccurred() {
+     return Xevaluator.UDFOccurred() ||
+            Yevaluator.UDFOccurred();
+}
+
+bool visualizer::FPEOccurred() {
+     return Xevaluator.FPEOccurred() ||
+            Yevaluator.FPEOccurred();
+}
+
+// the y expression is not used in image mode
+bool visualizer::parseErrorOccurred() {
+     return Xevaluator.currentExpressionBad() ||
+            (global_plot_mode == PLOT_MODE_CURVE && Yevaluator.currentExpressionBad());
+}
+
+bool visualizer::evaluationErrorOccurred() {
+     return FPEOccurred() || UDFOccurred();
+}
+
+void visualizer::resetInvalidIndices() {
+     Xevaluator.resetInvalidIndices();
+     Yevaluator.resetInvalidIndices();
+}
+
+// the render mode the current sweep is drawn in
+render_mode_value visualizer::getRenderMode() {
+     return getNumValues() > LINES_MAX_SAMPLES ? RENDER_MODE_POINTS : global_render_mode;
+}
+
+// lines need every sample in order, the pyramid only serves points
+bool visualizer::usePyramid(const displayParameters &dp) {
+     return pyramid.isBuilt() && getRenderMode() == RENDER_MODE_POINTS && dp.incx == 1;
+}
+
+// renders into any framebuffer size, dp maps samples onto it
+void visualizer::renderPlot(framebuffer &target, const displayParameters &dp) {
+     const render_mode_value mode = getRenderMode();
+
+     sample_px.resize(0);
+     sample_py.resize(0);
+
+     if (!parseErrorOccurred() && !evaluationErrorOccurred()) {
+         if (usePyramid(dp)) {
+             pyramid.collect(dp, Xevaluator.getValues(), Yevaluator.getValues(), sample_px, sample_py);
+         }
+         else {
+             for (int p = 0; p < num_values; p += dp.incx) {
+                  ldouble px, py;
+                  mapSample(dp, plotValue(dp, Xevaluator.getValue(p)), plotValue(dp, Yevaluator.getValue(p)), px, py);
+                  sample_px.push_back(px);
+                  sample_py.push_back(py);
+             }
+         }
+
+         // axes go through the origin, which moves with zoom and pan
+         ldouble zx, zy;
+         int zerox = -1, zeroy = -1;
+         mapSample(dp, 0.0, 0.0, zx, zy);
+         if (zx >= 0.0 && zx < dp.vis_diffx)
+             zerox = (int)zx;
+         if (zy >= 0.0 && zy < dp.vis_diffy)
+             zeroy = (int)dp.vis_diffy - (int)(dp.vis_diffy - zy);
+
+         rasterizer.render(target, sample_px, sample_py, mode, zerox, zeroy);
+     }
+     else {
+         target.clear(BACKGROUND_RGB);
+     }
+}
+
+// image mode keeps the last rendered image until the next EVALUATE
+void visualizer::renderImage() {
+     image_fb.resize(w(),h());
+     if (Xevaluator.currentExpressionBad())
+         image_fb.clear(BACKGROUND_RGB);
+     else
+         Xevaluator.evaluateImage(image_fb);
+}
+
+// the next draw renders the plot again even if the view did not change
+void visualizer::invalidatePlot() {
+     fb_valid = false;
+}
+
+void visualizer::buildPyramid() {
+     if (!parseErrorOccurred() && !evaluationErrorOccurred() && getNumValues() >= PYRAMID_MIN_SAMPLES)
+         pyramid.build(dparams, Xevaluator.getValues(), Yevaluator.getValues());
+     else
+         pyramid.clear();
+}
+
+void visualizer::setSweepStart(int64 first) {
+     sweep_first = first;
+}
+
+// scales both axis ranges by factor around the data point under (cx,cy)
+void visualizer::zoomAt(int cx, int cy, ldouble factor) {
+     const ldouble fx = (ldouble)cx/dparams.vis_diffx;
+     const ldouble fy = (ldouble)(h() - cy)/dparams.vis_diffy;
+     const ldouble dx = dparams.minx + fx*(dparams.maxx - dparams.minx);
+     const ldouble dy = dparams.miny + fy*(dparams.maxy - dparams.miny);
+     const ldouble wx = (dparams.maxx - dparams.minx)*factor;
+     const ldouble wy = (dparams.maxy - dparams.miny)*factor;
+
+     if (wx < MIN_ZOOM_RANGE || wy < MIN_ZOOM_RANGE)
+         return;
+     if (wx > 4.0*(ldouble)LLONG_MAX || wy > 4.0*(ldouble)LLONG_MAX)
+         return;
+
+     dparams.minx = dx - fx*wx;
+     dparams.maxx = dparams.minx + wx;
+     dparams.miny = dy - fy*wy;
+     dparams.maxy = dparams.miny + wy;
+}
+
+// moves the view with the mouse by a pixel offset
+void visualizer::pan(int dx, int dy) {
+     const ldouble sx = (ldouble)dx*(dparams.maxx - dparams.minx)/dparams.vis_diffx;
+     const ldouble sy = (ldouble)dy*(dparams.maxy - dparams.miny)/dparams.vis_diffy;
+
+     dparams.minx -= sx;
+     dparams.maxx -= sx;
+     dparams.miny += sy;
+     dparams.maxy += sy;
+}
+
+// sweeps that get a pyramid are queried through it instead
+void visualizer::buildIndex() {
+     if (!parseErrorOccurred() && !evaluationErrorOccurred() && getNumValues() < PYRAMID_MIN_SAMPLES)
+         tindex.build(dparams, Xevaluator.getValues(), Yevaluator.getValues());
+     else
+         tindex.clear();
+}
+
+// every t whose sample is drawn inside the canvas rectangle r
+void visualizer::queryT(const clipRect &r, std::vector<int64> &ts) {
+     std::vector<int> found;
+
+     ts.resize(0);
+
+     if (parseErrorOccurred() || evaluationErrorOccurred() || getNumValues() == 0)
+         return;
+
+     // the index only holds the view fitted by EVALUATE, nothing is
+     // rebuilt per query
+     if (usePyramid(dparams))
+         pyramid.query(dparams, Xevaluator.getValues(), Yevaluator.getValues(), r, found);
+     else if (tindex.isValidFor(dparams))
+         tindex.query(r, found);
+     else
+         rescanForPixels(dparams, Xevaluator.getValues(), Yevaluator.getValues(), r, found);
+
+     for (const auto & i: found)
+          ts.push_back(sweep_first + (int64)i);
+}
+
+bool visualizer::exportImage(int width, int height, const std::string &path) {
+     framebuffer out;
+     displayParameters dp = dparams;
+
+     dp.vis_maxx = dp.vis_diffx = (ldouble)width;
+     dp.vis_maxy = dp.vis_diffy = (ldouble)height;
+
+     num_values = getNumValues();
+     out.resize(width, height);
+     if (global_plot_mode == PLOT_MODE_IMAGE && !parseErrorOccurred())
+         Xevaluator.evaluateImage(out);
+     else
+         renderPlot(out, dp);
+     return out.writePPM(path);
+}
+
+void visualizer::resize(int x, int y, int w, int h) {
+     Fl_Box::resize(x,y,w,h);
+
+     dparams.vis_maxx = dparams.vis_diffx = (ldouble)w;
+     dparams.vis_maxy = dparams.vis_diffy = (ldouble)h;
+}
+
+void visualizer::draw() {
+     num_values = getNumValues();
+
+     if (global_plot_mode == PLOT_MODE_IMAGE && !parseErrorOccurred()) {
+         if (image_fb.getWidth() != w() || image_fb.getHeight() != h())
+             renderImage();
+         fl_draw_image(image_fb.getPixels(),x(),y(),w(),h(),3);
+     }
+     else {
+         // hovering and selecting only redraw the overlays below
+         if (!fb_valid || fb.getWidth() != w() || fb.getHeight() != h() ||
+             !sameView(fb_view, dparams) || fb_mode != global_render_mode) {
+             fb.resize(w(),h());
+             renderPlot(fb, dparams);
+             fb_view = dparams;
+             fb_mode = global_render_mode;
+             fb_valid = true;
+         }
+         fl_draw_image(fb.getPixels(),x(),y(),w(),h(),3);
+     }
+
+     if (sel_x0 >= 0) {
+         fl_color(FL_YELLOW);
+         fl_rect(x() + std::min(sel_x0,sel_x1), y() + std::min(sel_y0,sel_y1),
+                 std::abs(sel_x1 - sel_x0) + 1, std::abs(sel_y1 - sel_y0) + 1);
+     }
+
+     fl_color(FL_WHITE);
+     fl_font(FL_HELVETICA,16);
+
+     int tooltip_width = 0;
+
+     if (!parseErrorOccurred()) {
+         if (global_plot_mode == PLOT_MODE_CURVE && evaluationErrorOccurred()) {
+              if (FPEOccurred())
+                  fl_draw("Floating Point Exception",x()+8,y()+24);
+              else
+                  fl_draw("Undefined Behavior Triggered (shift)",x()+8,y()+24);
+         }
+     }
+     else {
+          evaluator *bad = Xevaluator.currentExpressionBad() ? &Xevaluator : &Yevaluator;
+          std::string err_str = std::string("Parse Error (") + (bad == &Xevaluator ? "x" : "y") +
+                                ", column " + std::to_string(bad->getErrorColumn()) + "): " + bad->getErrorMessage();
+          fl_draw(&err_str[0],x()+8,y()+24);
+     }
+
+     if (show_tooltip) {
+          tooltip_width = (int)cursor_str.size()*6;
+          fl_draw_box(FL_EMBOSSED_BOX,getClocx()-tooltip_width,getClocy() - 12,tooltip_width,12,FL_WHITE);
+          fl_color(FL_BLACK);
+          fl_font(FL_HELVETICA,10);
+          fl_draw(&cursor_str[0],getClocx()-tooltip_width+4,getClocy()-2);
+     }
+}
+
+void visualizer::updateMinMaxValues() {
+     dparams.unsigned_values = Xevaluator.valuesUnsigned();
+     fitDisplayParameters(dparams, Xevaluator.queryMinValue(), Xevaluator.queryMaxValue(),
+                          Yevaluator.queryMinValue(), Yevaluator.queryMaxValue());
+}
+
+int visualizer::getClocx() {
+     return Fl::event_x();
+}
+
+int visualizer::getClocy() {
+     return Fl::event_y();
+}
+
+int visualizer::handle(int e) {
+   switch (e) {
+       case(FL_LEAVE): {
+            show_tooltip = false;
+            redraw();
+            return 1;
+       }
+       case(FL_ENTER): {
+            show_tooltip = true;
+            redraw();
+            return 1;
+       }
+       case(FL_MOUSEWHEEL): {
+            if (Fl::event_dy() == 0 || global_plot_mode == PLOT_MODE_IMAGE)
+                break;
+            zoomAt(getClocx() - x(), getClocy() - y(), Fl::event_dy() > 0 ? ZOOM_STEP : 1.0/ZOOM_STEP);
+            redraw();
+            return 1;
+       }
+       // click or drag-select to list the t values plotted there,
+       // drag with the right button to pan (curves only)
+       case(FL_PUSH): {
+            if (global_plot_mode == PLOT_MODE_IMAGE)
+                break;
+            if (Fl::event_button() == FL_RIGHT_MOUSE) {
+                panning = true;
+                pan_x = getClocx();
+                pan_y = getClocy();
+                return 1;
+            }
+            if (Fl::event_button() != FL_LEFT_MOUSE)
+                break;
+            sel_x0 = sel_x1 = std::max(0, std::min(w() - 1, getClocx() - x()));
+            sel_y0 = sel_y1 = std::max(0, std::min(h() - 1, getClocy() - y()));
+            selecting = true;
+            redraw();
+            return 1;
+       }
+       case(FL_RELEASE): {
+            if (panning) {
+                panning = false;
+                return 1;
+            }
+            if (!selecting)
+                break;
+            selecting = false;
+            clipRect r = {std::min(sel_x0,sel_x1), std::min(sel_y0,sel_y1), std::max(sel_x0,sel_x1), std::max(sel_y0,sel_y1)};
+            std::vector<int64> ts;
+            queryT(r, ts);
+            showQueryResults(ts);
+            redraw();
+            return 1;
+       }
+       case(FL_DRAG):
+            if (panning) {
+                pan(getClocx() - pan_x, getClocy() - pan_y);
+                pan_x = getClocx();
+                pan_y = getClocy();
+            }
+            if (selecting) {
+                sel_x1 = std::max(0, std::min(w() - 1, getClocx() - x()));
+                sel_y1 = std::max(0, std::min(h() - 1, getClocy() - y()));
+            }
+            // the tooltip follows the drag
+            // fall through
+       case(FL_MOVE): {
+            if (global_plot_mode == PLOT_MODE_IMAGE) {
+                cursor_str = "t=" + std::to_string(getClocx()-x()) + ", s=" + std::to_string(getClocy()-y());
+                show_tooltip = true;
+                redraw();
+                return 1;
+            }
+            std::string clocx_str = formatCoordinate((ldouble)((getClocx()-x())*(dparams.maxx - dparams.minx)/dparams.vis_diffx) + dparams.minx);
+            std::string clocy_str = formatCoordinate((ldouble)((h() - getClocy() + y())*(dparams.maxy - dparams.miny)/dparams.vis_diffy) + dparams.miny);
+            cursor_str = "(" + clocx_str + "," + clocy_str + ")";
+            show_tooltip = true;
+            redraw();
+            return 1;
+       }
+       default:
+            break;
+   }
+   return(Fl_Box::handle(e));
+}
+
+evaluator *visualizer::getXEvaluator() {
+   return &Xevaluator;
+}
+
+evaluator *visualizer::getYEvaluator() {
+   return &Yevaluator;
+}
+
+program::program() {
+     depth = max_depth = 0;
+}
+
+void program::clear() {
+     instructions.resize(0);
+     depth = max_depth = 0;
+}
+
+// tracks the operand stack height so evaluation can preallocate it
+void program::emit(operator_value op, int64 value) {
+     instruction ins = {op, value};
+     instructions.push_back(ins);
+
+     if (op == OPERATOR_CST || op == OPERATOR_VAR)
+         depth++;
+     else if (op != OPERATOR_NOT && op != OPERATOR_NEG)
+         depth--;
+
+     max_depth = std::max(max_depth, depth);
+}
+
+int program::getStackDepth() const {
+     return max_depth;
+}
+
+int program::getNumInstructions() const {
+     return (int)instructions.size();
+}
+
+const std::vector<instruction> &program::getInstructions() const {
+     return instructions;
+}
+
+// stack must hold getStackDepth() elements
+template <typename T>
+fault_value program::evaluate(int64 t, int64 s, T *stack, T &result) const {
+     typedef wrapping<T> wrap;
+
+     const T tv = wrap::fromInt64(t);
+     const T sv = wrap::fromInt64(s);
+     int sp = -1;
+
+     for (const auto & ins: instructions) {
+          switch(ins.op) {
+                 case(OPERATOR_CST):
+                      stack[++sp] = wrap::fromInt64(ins.value);
+                      break;
+                 case(OPERATOR_VAR):
+                      stack[++sp] = (ins.value == VARIABLE_S) ? sv : tv;
+                      break;
+                 case(OPERATOR_NOT):
+                      stack[sp] = (T)~stack[sp];
+                      break;
+                 case(OPERATOR_NEG):
+                      stack[sp] = wrap::neg(stack[sp]);
+                      break;
+                 default: {
+                      fault_value fault = applyOperator<T>(ins.op, stack[sp-1], stack[sp], stack[sp-1]);
+                      if (fault != FAULT_NONE)
+                          return fault;
+                      sp--;
+                      break;
+                 }
+          }
+     }
+
+     result = stack[0];
+     return FAULT_NONE;
+}
+
+// in place transpose of a 64x64 bit matrix, bit c of m[r] <-> bit r of m[c]
+void transpose64(uint64_t *m) {
+    uint64_t mask = 0x00000000ffffffffULL;
+    for (int j = 32; j != 0; j >>= 1, mask ^= (mask << j)) {
+         for (int k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+              const uint64_t swap = ((m[k] >> j) ^ m[k | j]) & mask;
+              m[k] ^= swap << j;
+              m[k | j] ^= swap;
+         }
+    }
+}
+
+// Programs made only of ~, unary -, +, -, &, |, ^ and shifts by a literal
+// constant can be bit-sliced: no instruction can fault and each one is a
+// fixed sequence of word operations on bit planes. The literal is the
+// instruction right before the shift, since a constant is its own operand.
+template <typename T>
+bool canBitslice(const program &prog) {
+    typedef wrapping<T> wrap;
+
+    const std::vector<instruction> &code = prog.getInstructions();
+
+    for (size_t k = 0; k < code.size(); ++k) {
+         switch(code[k].op) {
+                case(OPERATOR_VAR):
+                     if (code[k].value != VARIABLE_T)
+                         return false;
+                     break;
+                case(OPERATOR_MUL):
+                case(OPERATOR_DIV):
+                case(OPERATOR_MOD):
+                     return false;
+                case(OPERATOR_LSF):
+                case(OPERATOR_RSF):
+                     if (k == 0 || code[k-1].op != OPERATOR_CST ||
+                         !wrap::shiftable(wrap::fromInt64(code[k-1].value)))
+                         return false;
+                     break;
+                default:
+                     break;
+         }
+    }
+
+    return !code.empty();
+}
+
+// Evaluates BITSLICE_LANES consecutive t values at once. Each operand is
+// stored as bits(T) words, word b holding bit b of every lane, so bitwise
+// operators are one word operation per bit and add/sub are a ripple carry
+// across the words. Appends the values of all whole groups among the count
+// t values from first and returns how many were done, the rest is left to
+// the scalar evaluator.
+template <typename T>
+uint64_t evaluateBitsliced(const program &prog, int64 first, uint64_t count, std::vector<int64> &values) {
+    typedef wrapping<T> wrap;
+    typedef typename std::make_unsigned<T>::type utype;
+
+    const int bits = (int)wrap::bits;
+    const std::vector<instruction> &code = prog.getInstructions();
+
+    std::vector<uint64_t> stack((size_t)prog.getStackDepth()*(size_t)bits);
+    uint64_t lanes[BITSLICE_LANES];
+    uint64_t tplanes[BITSLICE_LANES];
+
+    uint64_t done = 0;
+
+    for (; count - done >= BITSLICE_LANES; done += BITSLICE_LANES) {
+         for (int i = 0; i < BITSLICE_LANES; ++i)
+              tplanes[i] = (uint64_t)(utype)wrap::fromInt64((int64)((uint64_t)first + done + (uint64_t)i));
+         transpose64(tplanes);
+
+         int sp = -1;
+
+         for (size_t k = 0; k < code.size(); ++k) {
+              const instruction &ins = code[k];
+              uint64_t *a = &stack[(size_t)(sp < 0 ? 0 : sp)*bits];
+
+              switch(ins.op) {
+                     case(OPERATOR_CST): {
+                          const uint64_t c = (uint64_t)(utype)wrap::fromInt64(ins.value);
+                          uint64_t *dst = &stack[(size_t)(++sp)*bits];
+                          for (int b = 0; b < bits; ++b)
+                               dst[b] = ((c >> b) & 1ULL) ? ~0ULL : 0ULL;
+                          break;
+                     }
+                     case(OPERATOR_VAR): {
+                          uint64_t *dst = &stack[(size_t)(++sp)*bits];
+                          std::copy(tplanes, tplanes + bits, dst);
+                          break;
+                     }
+                     case(OPERATOR_NOT):
+                          for (int b = 0; b < bits; ++b)
+                               a[b] = ~a[b];
+                          break;
+                     case(OPERATOR_NEG): {
+                          // ~a + 1
+                          uint64_t carry = ~0ULL;
+                          for (int b = 0; b < bits; ++b) {
+                               const uint64_t x = ~a[b];
+                               a[b] = x ^ carry;
+                               carry &= x;
+                          }
+                          break;
+                     }
+                     case(OPERATOR_LSF):
+                     case(OPERATOR_RSF): {
+                          const int amount = (int)wrap::toInt64(wrap::fromInt64(code[k-1].value));
+                          uint64_t *v = &stack[(size_t)(--sp)*bits];
+                          if (ins.op == OPERATOR_LSF) {
+                              for (int b = bits - 1; b >= 0; --b)
+                                   v[b] = (b >= amount) ? v[b - amount] : 0ULL;
+                          }
+                          else {
+                              // arithmetic for signed types, like wrap::rsf
+                              const uint64_t fill = std::is_signed<T>::value ? v[bits - 1] : 0ULL;
+                              for (int b = 0; b < bits; ++b)
+                                   v[b] = (b + amount < bits) ? v[b + amount] : fill;
+                          }
+                          break;
+                     }
+                     default: {
+                          const uint64_t *y = &stack[(size_t)sp*bits];
+                          uint64_t *x = &stack[(size_t)(--sp)*bits];
+                          switch(ins.op) {
+                                 case(OPERATOR_ADD):
+                                 case(OPERATOR_SUB): {
+                                      // x - y is x + ~y + 1
+                                      const uint64_t flip = (ins.op == OPERATOR_SUB) ? ~0ULL : 0ULL;
+                                      uint64_t carry = flip;
+                                      for (int b = 0; b < bits; ++b) {
+                                           const uint64_t yb = y[b] ^ flip;
+                                           const uint64_t half = x[b] ^ yb;
+                                           const uint64_t sum = half ^ carry;
+                                           carry = (x[b] & yb) | (carry & half);
+                                           x[b] = sum;
+                                      }
+                                      break;
+                                 }
+                                 case(OPERATOR_AND):
+                                      for (int b = 0; b < bits; ++b)
+                                           x[b] &= y[b];
+                                      break;
+                                 case(OPERATOR_XOR):
+                                      for (int b = 0; b < bits; ++b)
+                                           x[b] ^= y[b];
+                                      break;
+                                 case(OPERATOR_IOR):
+                                      for (int b = 0; b < bits; ++b)
+                                           x[b] |= y[b];
+                                      break;
+                                 default:
+                                      break;
+                          }
+                          break;
+                     }
+              }
+         }
+
+         std::fill(lanes, lanes + BITSLICE_LANES, 0ULL);
+         std::copy(stack.begin(), stack.begin() + bits, lanes);
+         transpose64(lanes);
+
+         for (int i = 0; i < BITSLICE_LANES; ++i)
+              values.push_back(wrap::toInt64((T)(utype)lanes[i]));
+    }
+
+    return done;
+}
+
+// appends one value per t to values, stops at the first fault and reports
+// its t in fault_t. The loop counts samples (in unsigned arithmetic) rather
+// than comparing t to last, which could never exceed LLONG_MAX.
+template <typename T>
+fault_value evaluateProgramAs(const program &prog, int64 first, int64 last, std::vector<int64> &values, int64 &fault_t) {
+    std::vector<T> stack(std::max(prog.getStackDepth(), 1));
+    T result;
+
+    const uint64_t count = (uint64_t)last - (uint64_t)first + 1;
+    uint64_t done = 0;
+
+    values.reserve(values.size() + (size_t)count);
+
+    if (count >= BITSLICE_MIN_SAMPLES &&
+        prog.getNumInstructions() >= BITSLICE_MIN_INSTRUCTIONS + (int)wrapping<T>::bits/16 &&
+        canBitslice<T>(prog))
+        done = evaluateBitsliced<T>(prog, first, count, values);
+
+    for (; done < count; ++done) {
+         const int64 t = (int64)((uint64_t)first + done);
+         fault_value fault = prog.evaluate<T>(t, 0LL, &stack[0], result);
+         if (fault != FAULT_NONE) {
+             fault_t = t;
+             return fault;
+         }
+         values.push_back(wrapping<T>::toInt64(result));
+    }
+
+    return FAULT_NONE;
+}
+
+fault_value evaluateProgram(const program &prog, int_width_value width, int64 first, int64 last, std::vector<int64> &values, int64 &fault_t) {
+    switch(width) {
+           case(INT_WIDTH_S8):
+                return evaluateProgramAs<int8_t>(prog,first,last,values,fault_t);
+           case(INT_WIDTH_U8):
+                return evaluateProgramAs<uint8_t>(prog,first,last,values,fault_t);
+           case(INT_WIDTH_S16):
+                return evaluateProgramAs<int16_t>(prog,first,last,values,fault_t);
+           case(INT_WIDTH_U16):
+                return evaluateProgramAs<uint16_t>(prog,first,last,values,fault_t);
+           case(INT_WIDTH_S32):
+                return evaluateProgramAs<int32_t>(prog,first,last,values,fault_t);
+           case(INT_WIDTH_U32):
+                return evaluateProgramAs<uint32_t>(prog,first,last,values,fault_t);
+           case(INT_WIDTH_U64):
+                return evaluateProgramAs<uint64_t>(prog,first,last,values,fault_t);
+           default:
+                break;
+    }
+    return evaluateProgramAs<int64_t>(prog,first,last,values,fault_t);
+}
+
+// v2 op v1 across n lanes. Lanes that fault are flagged and continue with a
+// divisor of 1 or a shift of 0, so the loops have no early exit.
+template <typename T>
+void applyOperatorLanes(operator_value op, T *v2, const T *v1, int n, unsigned char *faulted) {
+    typedef wrapping<T> wrap;
+
+    switch(op) {
+           case(OPERATOR_MUL):
+                for (int i = 0; i < n; ++i)
+                     v2[i] = wrap::mul(v2[i],v1[i]);
+                break;
+           case(OPERATOR_DIV):
+           case(OPERATOR_MOD):
+                for (int i = 0; i < n; ++i) {
+                     const bool bad = (v1[i] == (T)0);
+                     const T d = bad ? (T)1 : v1[i];
+                     faulted[i] |= (unsigned char)bad;
+                     v2[i] = (op == OPERATOR_DIV) ? wrap::div(v2[i],d) : wrap::mod(v2[i],d);
+                }
+                break;
+           case(OPERATOR_ADD):
+                for (int i = 0; i < n; ++i)
+                     v2[i] = wrap::add(v2[i],v1[i]);
+                break;
+           case(OPERATOR_SUB):
+                for (int i = 0; i < n; ++i)
+                     v2[i] = wrap::sub(v2[i],v1[i]);
+                break;
+           case(OPERATOR_LSF):
+           case(OPERATOR_RSF):
+                for (int i = 0; i < n; ++i) {
+                     const bool bad = !wrap::shiftable(v1[i]);
+                     const T amount = bad ? (T)0 : v1[i];
+                     faulted[i] |= (unsigned char)bad;
+                     v2[i] = (op == OPERATOR_LSF) ? wrap::lsf(v2[i],amount) : wrap::rsf(v2[i],amount);
+                }
+                break;
+           case(OPERATOR_AND):
+                for (int i = 0; i < n; ++i)
+                     v2[i] = (T)(v2[i] & v1[i]);
+                break;
+           case(OPERATOR_XOR):
+                for (int i = 0; i < n; ++i)
+                     v2[i] = (T)(v2[i] ^ v1[i]);
+                break;
+           case(OPERATOR_IOR):
+                for (int i = 0; i < n; ++i)
+                     v2[i] = (T)(v2[i] | v1[i]);
+                break;
+           default:
+                break;
+    }
+}
+
+// Evaluates t = t0 .. t0+n-1 (n <= TILE_SIZE) at a fixed s. Every
+// instruction runs over the whole row before the next one, which keeps the
+// interpreter overhead per instruction instead of per pixel and leaves
+// simple array loops for the compiler to vectorize. stack holds
+// getStackDepth() rows of TILE_SIZE lanes; the result is in the first row.
+template <typename T>
+void evaluateRowAs(const program &prog, int64 t0, int64 s, int n, T *stack, unsigned char *faulted) {
+    typedef wrapping<T> wrap;
+
+    int sp = -1;
+
+    std::fill(faulted, faulted + n, (unsigned char)0);
+
+    for (const auto & ins: prog.getInstructions()) {
+         T *top = stack + (size_t)(sp < 0 ? 0 : sp)*TILE_SIZE;
+
+         switch(ins.op) {
+                case(OPERATOR_CST):
+                     top = stack + (size_t)(++sp)*TILE_SIZE;
+                     std::fill(top, top + n, wrap::fromInt64(ins.value));
+                     break;
+                case(OPERATOR_VAR):
+                     top = stack + (size_t)(++sp)*TILE_SIZE;
+                     if (ins.value == VARIABLE_S) {
+                         std::fill(top, top + n, wrap::fromInt64(s));
+                     }
+                     else {
+                         for (int i = 0; i < n; ++i)
+                              top[i] = wrap::fromInt64((int64)((uint64_t)t0 + (uint64_t)i));
+                     }
+                     break;
+                case(OPERATOR_NOT):
+                     for (int i = 0; i < n; ++i)
+                          top[i] = (T)~top[i];
+                     break;
+                case(OPERATOR_NEG):
+                     for (int i = 0; i < n; ++i)
+                          top[i] = wrap::neg(top[i]);
+                     break;
+                default:
+                     sp--;
+                     applyOperatorLanes<T>(ins.op, stack + (size_t)sp*TILE_SIZE, top, n, faulted);
+                     break;
+         }
+    }
+}
+
+// pixel (x,y) shows the low byte of f(t=x, s=y) as gray, faults are black
+template <typename T>
+void renderImageAs(const program &prog, framebuffer &fb) {
+    const int tiles_x = (fb.getWidth() + TILE_SIZE - 1) / TILE_SIZE;
+    const int tiles_y = (fb.getHeight() + TILE_SIZE - 1) / TILE_SIZE;
+    const size_t depth = (size_t)std::max(prog.getStackDepth(), 1);
+
+    getThreadPool().parallelFor(tiles_x*tiles_y, [&](int tile) {
+         std::vector<T> stack(depth*TILE_SIZE);
+         unsigned char faulted[TILE_SIZE];
+
+         const int x0 = (tile % tiles_x)*TILE_SIZE;
+         const int y0 = (tile / tiles_x)*TILE_SIZE;
+         const int n = std::min(TILE_SIZE, fb.getWidth() - x0);
+         const int y1 = std::min(y0 + TILE_SIZE, fb.getHeight());
+
+         for (int y = y0; y < y1; ++y) {
+              evaluateRowAs<T>(prog, (int64)x0, (int64)y, n, &stack[0], faulted);
+              for (int i = 0; i < n; ++i) {
+                   const unsigned int gray = faulted[i] ? 0u : (unsigned int)(unsigned char)stack[i];
+                   fb.setPixel(x0 + i, y, gray*0x010101u);
+              }
+         }
+    });
+}
+
+void renderImage(const program &prog, int_width_value width, framebuffer &fb) {
+    switch(width) {
+           case(INT_WIDTH_S8):
+                renderImageAs<int8_t>(prog,fb);
+                return;
+           case(INT_WIDTH_U8):
+                renderImageAs<uint8_t>(prog,fb);
+                return;
+           case(INT_WIDTH_S16):
+                renderImageAs<int16_t>(prog,fb);
+                return;
+           case(INT_WIDTH_U16):
+                renderImageAs<uint16_t>(prog,fb);
+                return;
+           case(INT_WIDTH_S32):
+                renderImageAs<int32_t>(prog,fb);
+                return;
+           case(INT_WIDTH_U32):
+                renderImageAs<uint32_t>(prog,fb);
+                return;
+           case(INT_WIDTH_U64):
+                renderImageAs<uint64_t>(prog,fb);
+                return;
+           default:
+                break;
+    }
+    renderImageAs<int64_t>(prog,fb);
+}
+
+void lexer::init(const char *str, int length) {
+     src = str;
+     len = length;
+     pos = 0;
+}
+
+token lexer::next() {
+     while (pos < len && src[pos] == ' ')
+            pos++;
+
+     token tok = {TOKEN_END, OPERATOR_CST, PARSE_ERROR_NONE, pos, 0LL};
+
+     if (pos >= len)
+         return tok;
+
+     const char c = src[pos];
+
+     if (isHexDigit(c)) {
+         tok.type = TOKEN_CONSTANT_OPERAND;
+         for (; pos < len && isHexDigit(src[pos]); ++pos) {
+              if (pos - tok.pos >= MAX_CONSTANT_HEXDIGITS) {
+                  tok.type = TOKEN_INVALID;
+                  tok.error = PARSE_ERROR_CONSTANT_TOO_LONG;
+                  return tok;
+              }
+              tok.value = (tok.value << 4) | getHexDigitValue(src[pos]);
+         }
+         return tok;
+     }
+
+     pos++;
+
+     switch(c) {
+         case('t'):
+         case('s'):
+              tok.type = TOKEN_VARIABLE_OPERAND;
+              tok.op = OPERATOR_VAR;
+              tok.value = (c == 's') ? VARIABLE_S : VARIABLE_T;
+              return tok;
+         case('('):
+              tok.type = TOKEN_PARENTHESIS_OPEN;
+              return tok;
+         case(')'):
+              tok.type = TOKEN_PARENTHESIS_CLOSE;
+              return tok;
+         case('~'):
+              tok.type = TOKEN_PREFIX_OPERATOR;
+              tok.op = OPERATOR_NOT;
+              return tok;
+         case('*'):
+              tok.op = OPERATOR_MUL;
+              break;
+         case('/'):
+              tok.op = OPERATOR_DIV;
+              break;
+         case('%'):
+              tok.op = OPERATOR_MOD;
+              break;
+         case('+'):
+              tok.op = OPERATOR_ADD;
+              break;
+         // unary minus is decided by the parser from its position
+         case('-'):
+              tok.op = OPERATOR_SUB;
+              break;
+         case('<'):
+         case('>'):
+              if (pos >= len || src[pos] != c) {
+                  tok.type = TOKEN_INVALID;
+                  tok.error = PARSE_ERROR_SINGLE_SHIFT;
+                  return tok;
+              }
+              pos++;
+              tok.op = (c == '<') ? OPERATOR_LSF : OPERATOR_RSF;
+              break;
+         case('&'):
+              tok.op = OPERATOR_AND;
+              break;
+         case('^'):
+              tok.op = OPERATOR_XOR;
+              break;
+         case('|'):
+              tok.op = OPERATOR_IOR;
+              break;
+         default:
+              tok.type = TOKEN_INVALID;
+              tok.error = PARSE_ERROR_INVALID_CHAR;
+              return tok;
+     }
+
+     tok.type = TOKEN_INFIX_OPERATOR;
+     return tok;
+}
+
+expression_parser::expression_parser() {
+     error = PARSE_ERROR_NONE;
+     error_pos = 0;
+     allow_s = false;
+}
+
+bool expression_parser::parse(const std::string &str, program &prog) {
+     error = PARSE_ERROR_NONE;
+     error_pos = 0;
+
+     prog.clear();
+     lex.init(str.data(), (int)str.size());
+     advance();
+
+     if (current.type == TOKEN_END)
+         fail(PARSE_ERROR_EMPTY, current.pos);
+
+     parseBinary(prog, operator_prec[NUM_ALLOWED_OPERATORS-1], 0);
+
+     if (current.type == TOKEN_PARENTHESIS_CLOSE)
+         fail(PARSE_ERROR_UNMATCHED_CLOSE, current.pos);
+     else if (current.type != TOKEN_END)
+         fail(PARSE_ERROR_EXPECTED_OPERATOR, current.pos);
+
+     return error == PARSE_ERROR_NONE;
+}
+
+// s is accepted as a second variable only when allowed (image mode)
+void expression_parser::allowVariableS(bool allow) {
+     allow_s = allow;
+}
+
+parse_error_value expression_parser::getError() {
+     return error;
+}
+
+// 1-based column of the first error, 0 when the expression is valid
+int expression_parser::getErrorColumn() {
+     return error == PARSE_ERROR_NONE ? 0 : error_pos + 1;
+}
+
+void expression_parser::advance() {
+     current = lex.next();
+     if (current.type == TOKEN_INVALID)
+         fail(current.error, current.pos);
+}
+
+// only the first error is kept, the parse then unwinds without emitting
+void expression_parser::fail(parse_error_value err, int pos) {
+     if (error != PARSE_ERROR_NONE)
+         return;
+     error = err;
+     error_pos = pos;
+     current.type = TOKEN_END;
+}
+
+// binary operators with operator_prec <= max_prec (lower binds tighter)
+void expression_parser::parseBinary(program &prog, int max_prec, int depth) {
+     parseUnary(prog, depth);
+
+     while (error == PARSE_ERROR_NONE && current.type == TOKEN_INFIX_OPERATOR) {
+            operator_value op = current.op;
+            int prec = operator_prec[(int)op-2];
+
+            if (prec > max_prec)
+                break;
+
+            advance();
+            parseBinary(prog, prec - 1, depth);
+
+            if (error != PARSE_ERROR_NONE)
+                return;
+
+            prog.emit(op, 0LL);
+     }
+}
+
+void expression_parser::parseUnary(program &prog, int depth) {
+     if (error != PARSE_ERROR_NONE)
+         return;
+
+     if (depth > MAX_PARSE_DEPTH) {
+         fail(PARSE_ERROR_TOO_DEEP, current.pos);
+         return;
+     }
+
+     token tok = current;
+
+     switch(tok.type) {
+         case(TOKEN_CONSTANT_OPERAND):
+              prog.emit(OPERATOR_CST, tok.value);
+              advance();
+              return;
+         case(TOKEN_VARIABLE_OPERAND):
+              if (tok.value == VARIABLE_S && !allow_s)
+                  break;
+              prog.emit(OPERATOR_VAR, tok.value);
+              advance();
+              return;
+         case(TOKEN_PREFIX_OPERATOR):
+         case(TOKEN_INFIX_OPERATOR):
+              if (tok.op != OPERATOR_NOT && tok.op != OPERATOR_SUB)
+                  break;
+              advance();
+              parseUnary(prog, depth + 1);
+              if (error == PARSE_ERROR_NONE)
+                  prog.emit(tok.op == OPERATOR_SUB ? OPERATOR_NEG : OPERATOR_NOT, 0LL);
+              return;
+         case(TOKEN_PARENTHESIS_OPEN):
+              advance();
+              parseBinary(prog, operator_prec[NUM_ALLOWED_OPERATORS-1], depth + 1);
+              if (error != PARSE_ERROR_NONE)
+                  return;
+              if (current.type != TOKEN_PARENTHESIS_CLOSE) {
+                  fail(current.type == TOKEN_END ? PARSE_ERROR_MISSING_CLOSE : PARSE_ERROR_EXPECTED_OPERATOR, current.pos);
+                  return;
+              }
+              advance();
+              return;
+         default:
+              break;
+     }
+
+     fail(tok.type == TOKEN_VARIABLE_OPERAND ? PARSE_ERROR_S_OUTSIDE_IMAGE : PARSE_ERROR_EXPECTED_OPERAND, tok.pos);
+}
+
+evaluator::evaluator() {
+   int_width = INT_WIDTH_S64;
+}
+
+int64 evaluator::getValue(int i) {
+   return values[i];
+}
+
+const std::vector<int64> &evaluator::getValues() {
+   return values;
+}
+
+ldouble evaluator::queryMinValue() {
+   ldouble lo, hi;
+   valueRange(values, valuesUnsigned(), lo, hi);
+   return lo;
+}
+
+ldouble evaluator::queryMaxValue() {
+   ldouble lo, hi;
+   valueRange(values, valuesUnsigned(), lo, hi);
+   return hi;
+}
+
+bool evaluator::valuesUnsigned() {
+   return int_width == INT_WIDTH_U64;
+}
+
+void evaluator::init(std::string init_str) {
+    fpe_index = udf_index = VALID_CONSTANT_IND;
+    bad_expression = false;
+    expression_str = init_str;
+}
+
+void evaluator::parseExpression(std::string str) {
+    expression_str = str;
+    bad_expression = !parser.parse(expression_str, prog);
+}
+
+bool evaluator::currentExpressionBad() {
+    return bad_expression;
+}
+
+bool evaluator::evaluationErrorOccurred() {
+    return FPEOccurred() || UDFOccurred();
+}
+
+bool evaluator::FPEOccurred() {
+    return fpe_index != VALID_CONSTANT_IND;
+}
+
+bool evaluator::UDFOccurred() {
+    return udf_index != VALID_CONSTANT_IND;
+}
+
+void evaluator::setIntWidth(int_width_value width) {
+    int_width = width;
+}
+
+// takes effect with the next parseExpression
+void evaluator::setImageMode(bool image_mode) {
+    parser.allowVariableS(image_mode);
+}
+
+void evaluator::evaluateImage(framebuffer &target) {
+    if (!bad_expression)
+        renderImage(prog, int_width, target);
+}
+
+bool evaluator::writeBytebeat(const std::string &path, int rate, int64 num_samples) {
+    if (bad_expression)
+        return false;
+    std::ofstream out(path.c_str(), std::ios::binary);
+    return out && streamBytebeat(prog, int_width, rate, num_samples, true, out);
+}
+
+// dispatch once per sweep to the instantiation for the selected width
+void evaluator::evaluateRange(int64 first, int64 last) {
+    if (bad_expression)
+        return;
+
+    int64 fault_t = 0;
+    fault_value fault = evaluateProgram(prog, int_width, first, last, values, fault_t);
+
+    if (fault == FAULT_FPE)
+        fpe_index = fault_t;
+    if (fault == FAULT_UDF)
+        udf_index = fault_t;
+}
+
+void evaluator::clearValues() {
+    values.resize(0);
+}
+
+void evaluator::resetInvalidIndices() {
+    fpe_index = udf_index = VALID_CONSTANT_IND;
+}
+
+int evaluator::getNumValues() {
+     return (int)values.size();
+}
 
-         token tok = {x,getTokenType(x)};
+int evaluator::getErrorColumn() {
+     return parser.getErrorColumn();
+}
 
-         if ((int)tok.value.size() > MAX_CONSTANT_HEXDIGITS || tok.value == "<" || tok.value == ">") {
-             bad_expression = true;
-             return;
-         }
+std::string evaluator::getErrorMessage() {
+     return std::string(parse_error_messages[parser.getError()]);
+}
 
-         tokens.push_back(tok);
-    }
+std::string evaluator::getExpressionString() {
+     std::string str = expression_str;
+     str.erase(std::remove(str.begin(), str.end(), ' '), str.end());
+     return str;
+}
 
-    expression_str.erase(std::remove(expression_str.begin(), expression_str.end(), 'u'), expression_str.end());
+// image mode only uses the x field, as f(t,s)
+void evaluateImageEquation(visualizer *vis) {
+     vis->resetInvalidIndices();
+     vis->getXEvaluator()->parseExpression(temp_global_strx);
+     vis->getXEvaluator()->setIntWidth(global_int_width);
+     parse_success = !vis->parseErrorOccurred();
+     if (parse_success)
+         temp_global_strx = vis->getXEvaluator()->getExpressionString();
+     vis->renderImage();
+     vis->redraw();
+}
 
-    populateParseTokens();
+void evaluateParametricEquations(visualizer *vis) {
+     if (global_plot_mode == PLOT_MODE_IMAGE) {
+         evaluateImageEquation(vis);
+         return;
+     }
+     vis->resetInvalidIndices();
+     vis->getXEvaluator()->clearValues();
+     vis->getYEvaluator()->clearValues();
+     vis->getXEvaluator()->parseExpression(temp_global_strx);
+     vis->getYEvaluator()->parseExpression(temp_global_stry);
+     vis->getXEvaluator()->setIntWidth(global_int_width);
+     vis->getYEvaluator()->setIntWidth(global_int_width);
+     parse_success = !vis->parseErrorOccurred();
+     if (parse_success) {
+         vis->getXEvaluator()->evaluateRange(global_sweep_first,global_sweep_last);
+         if (!vis->evaluationErrorOccurred())
+             vis->getYEvaluator()->evaluateRange(global_sweep_first,global_sweep_last);
+         temp_global_strx = vis->getXEvaluator()->getExpressionString();
+         temp_global_stry = vis->getYEvaluator()->getExpressionString();
+     }
+     if (!vis->evaluationErrorOccurred() && parse_success)
+         vis->updateMinMaxValues();
+     vis->setSweepStart(global_sweep_first);
+     vis->buildIndex();
+     vis->buildPyramid();
+     vis->invalidatePlot();
+     vis->redraw();
+}
 
-    bad_expression = checkInvalidExpression();
+void showQueryResults(const std::vector<int64> &ts) {
+     query_browser->clear();
+     query_browser->add((std::to_string(ts.size()) + (ts.size() == 1 ? " t value" : " t values")).c_str());
+     for (size_t i = 0; i < ts.size() && i < QUERY_MAX_LISTED; ++i)
+          query_browser->add(("t = " + std::to_string(ts[i])).c_str());
+     if (ts.size() > QUERY_MAX_LISTED)
+         query_browser->add(("... " + std::to_string(ts.size() - QUERY_MAX_LISTED) + " more").c_str());
 }
 
-bool evaluator::checkInvalidChars() {
-    for (const auto & c: expression_str) {
-         if (!isHexDigit(c) && !isVariable(c) && !isOperatorChar(c) && !isParenthesis(c) && c != ' ') {
-             return true;
+void evaluateButton_CB(Fl_Widget *w, void *data) {
+     Fl_Button * btn = (Fl_Button *)w;
+     if (btn->value() == 1) {
+         evaluateParametricEquations((visualizer *)data);
+         if (parse_success) {
+             inpx->value(&temp_global_strx[0]);
+             inpy->value(&temp_global_stry[0]);
          }
-    }
-    return false;
+     }
 }
 
-bool evaluator::currentExpressionBad() {
-    return bad_expression;
+// re-parsed on every keystroke so errors show up while typing
+void modifyExpressionXString_CB(Fl_Widget *w, void *data) {
+     Fl_Input * inp = (Fl_Input *)w;
+     visualizer * vis = (visualizer *)data;
+     temp_global_strx = std::string(inp->value());
+     vis->getXEvaluator()->parseExpression(temp_global_strx);
+     vis->invalidatePlot();
+     vis->redraw();
 }
 
-bool evaluator::evaluationErrorOccurred() {
-    return FPEOccurred() || UDFOccurred();
+void modifyExpressionYString_CB(Fl_Widget *w, void *data) {
+     Fl_Input * inp = (Fl_Input *)w;
+     visualizer * vis = (visualizer *)data;
+     temp_global_stry = std::string(inp->value());
+     vis->getYEvaluator()->parseExpression(temp_global_stry);
+     vis->invalidatePlot();
+     vis->redraw();
 }
 
-bool evaluator::FPEOccurred() {
-    return fpe_index != VALID_CONSTANT_IND;
+void modifyIntWidth_CB(Fl_Widget *w, void *data) {
+     Fl_Choice * chc = (Fl_Choice *)w;
+     global_int_width = (int_width_value)chc->value();
 }
 
-bool evaluator::UDFOccurred() {
-    return udf_index != VALID_CONSTANT_IND;
+void exportButton_CB(Fl_Widget *w, void *data) {
+     visualizer * vis = (visualizer *)data;
+     if (vis->exportImage(EXPORT_WIDTH, EXPORT_HEIGHT, "plot_export.ppm"))
+         std::cout << "wrote plot_export.ppm (" << EXPORT_WIDTH << "x" << EXPORT_HEIGHT << ")" << std::endl;
+     else
+         std::cerr << "could not write plot_export.ppm" << std::endl;
 }
 
-void evaluator::populateParseTokens() {
-    for (const auto & t: tokens) {
-         switch(t.type) {
-                case(TOKEN_CONSTANT_OPERAND):
-                case(TOKEN_VARIABLE_OPERAND):
-                     parse_results.push_back('x');
-                     break;
-                case(TOKEN_PARENTHESIS_OPEN):
-                     parse_results.push_back('(');
-                     break;
-                case(TOKEN_PARENTHESIS_CLOSE):
-                     parse_results.push_back(')');
-                     break;
-                case(TOKEN_INFIX_OPERATOR):
-                     parse_results.push_back('i');
-                     break;
-                case(TOKEN_PREFIX_OPERATOR):
-                     parse_results.push_back('p');
-                     break;
-                default:
-                     break;
-         }
-    }
+// ranges that are reversed or longer than MAX_SWEEP_SAMPLES are ignored
+// until both fields make sense
+void modifySweepRange_CB(Fl_Widget *w, void *data) {
+     int64 first, last;
+
+     std::istringstream in_first(inpt0->value());
+     std::istringstream in_last(inpt1->value());
+
+     if (!(in_first >> first) || !(in_last >> last))
+         return;
+     if (last < first || (ldouble)last - (ldouble)first >= (ldouble)MAX_SWEEP_SAMPLES)
+         return;
+
+     global_sweep_first = first;
+     global_sweep_last = last;
 }
 
-bool evaluator::checkInvalidExpression() {
-    auto num_operands = std::count(parse_results.begin(), parse_results.end(), 'x');
-    auto num_parenthso = std::count(parse_results.begin(), parse_results.end(), '(');
-    auto num_parenthsc = std::count(parse_results.begin(), parse_results.end(), ')');
-    auto num_infix_operators = std::count(parse_results.begin(), parse_results.end(), 'i');
-    auto num_prefix_operators = std::count(parse_results.begin(), parse_results.end(), 'p');
-
-    auto invalid_consecutive_tokens = false;
-
-    if ((int)parse_results.size() > 1) {
-         for (auto i = 0; i < (int)parse_results.size() - 1; ++i) {
-              auto this_val = parse_results[i];
-              auto next_val = parse_results[i+1];
-
-              if ((this_val == 'x' && next_val == 'x') ||
-                  (this_val == 'i' && next_val == 'i') ||
-                  (this_val == '(' && next_val == ')') ||
-                  (this_val == ')' && next_val == '(') ||
-                  (this_val == 'x' && next_val == '(') ||
-                  (this_val == ')' && next_val == 'x') ||
-                  (this_val == 'i' && next_val == ')') ||
-                  (this_val == '(' && next_val == 'i') ||
-                  (this_val == 'p' && next_val == 'p') ||
-                  (this_val == 'p' && next_val == 'i') ||
-                  (this_val == 'p' && next_val == ')') ||
-                  (this_val == 'x' && next_val == 'p') ||
-                  (this_val == ')' && next_val == 'p')) {
-                   invalid_consecutive_tokens = true;
-                   break;
-              }
-         }
-    }
+void modifyPlotMode_CB(Fl_Widget *w, void *data) {
+     Fl_Light_Button * btn = (Fl_Light_Button *)w;
+     visualizer * vis = (visualizer *)data;
+     global_plot_mode = btn->value() ? PLOT_MODE_IMAGE : PLOT_MODE_CURVE;
+     vis->getXEvaluator()->setImageMode(global_plot_mode == PLOT_MODE_IMAGE);
+     evaluateParametricEquations(vis);
+     if (parse_success)
+         inpx->value(&temp_global_strx[0]);
+}
+
+// the x expression as bytebeat audio, parsed but not necessarily evaluated
+void bytebeatButton_CB(Fl_Widget *w, void *data) {
+     visualizer * vis = (visualizer *)data;
+     vis->getXEvaluator()->setIntWidth(global_int_width);
+     if (vis->getXEvaluator()->writeBytebeat("bytebeat.wav", BYTEBEAT_EXPORT_RATE, (int64)BYTEBEAT_EXPORT_RATE*BYTEBEAT_EXPORT_SECONDS))
+         std::cout << "wrote bytebeat.wav (" << BYTEBEAT_EXPORT_SECONDS << " s at " << BYTEBEAT_EXPORT_RATE << " Hz)" << std::endl;
+     else
+         std::cerr << "could not write bytebeat.wav" << std::endl;
+}
+
+void modifyRenderMode_CB(Fl_Widget *w, void *data) {
+     Fl_Light_Button * btn = (Fl_Light_Button *)w;
+     global_render_mode = btn->value() ? RENDER_MODE_LINES : RENDER_MODE_POINTS;
+     ((visualizer *)data)->redraw();
+}
+
+std::shared_ptr<const program> program_cache::lookup(const std::string &expr, parse_error_value &error, int &column) {
+     {
+          std::unique_lock<std::mutex> lock(mtx);
+          auto it = index.find(expr);
+          if (it != index.end()) {
+              entries.splice(entries.begin(), entries, it->second);
+              error = PARSE_ERROR_NONE;
+              column = 0;
+              return it->second->second;
+          }
+     }
 
-    if (num_operands != num_infix_operators + 1)
-        return true;
+     // compile outside the lock, a racing duplicate compile is harmless
+     expression_parser parser;
+     std::shared_ptr<program> prog = std::make_shared<program>();
 
-    if (num_parenthso != num_parenthsc)
-        return true;
+     if (!parser.parse(expr, *prog)) {
+         error = parser.getError();
+         column = parser.getErrorColumn();
+         return std::shared_ptr<const program>();
+     }
 
-    if (invalid_consecutive_tokens)
-        return true;
+     error = PARSE_ERROR_NONE;
+     column = 0;
 
-    return false;
+     std::unique_lock<std::mutex> lock(mtx);
+     if (index.find(expr) == index.end()) {
+         entries.push_front(std::make_pair(expr, std::shared_ptr<const program>(prog)));
+         index[expr] = entries.begin();
+         if ((int)entries.size() > SERVER_PROGRAM_CACHE_SIZE) {
+             index.erase(entries.back().first);
+             entries.pop_back();
+         }
+     }
+     return prog;
 }
 
-void evaluator::simplifyExpression(int64 t) {
-    operator_value current_operator;
-    for (const auto & tok: tokens) {
-         switch(tok.type) {
-                case(TOKEN_CONSTANT_OPERAND):
-                     operands.push(getint64FromHexStr(tok.value));
-                     break;
-                case(TOKEN_VARIABLE_OPERAND):
-                     operands.push(t);
-                     break;
-                case(TOKEN_PARENTHESIS_OPEN):
-                     operators.push(OPERATOR_OPP);
-                     break;
-                case(TOKEN_PARENTHESIS_CLOSE):
-                     while(operators.top() != OPERATOR_OPP) {
-                           performOperation(t);
-                           if (evaluationErrorOccurred()) {
-                               resetStacks();
-                               return;
-                           }
-                     }
-                     operators.pop();
-                     break;
-                default:
-                     current_operator = getTokenOperatorEquivalent(tok);
-                     while(canPerformScopeOperation(current_operator)) {
-                           performOperation(t);
-                           if (evaluationErrorOccurred()) {
-                               resetStacks();
-                               return;
-                           }
-                     }
-                     operators.push(current_operator);
-                     break;
+// reply bytes are in host order, the server is only reachable from this host
+class reply_buffer {
+    public:
+         void putU32(uint32_t v) { put(&v, sizeof(v)); }
+         void putU64(uint64_t v) { put(&v, sizeof(v)); }
+         void putI64(int64_t v) { put(&v, sizeof(v)); }
+         void put(const void *src, size_t n) {
+              const char *c = (const char *)src;
+              bytes.insert(bytes.end(), c, c + n);
          }
-    }
+         void putString(const std::string &str) { put(str.data(), str.size()); }
+         std::vector<char> bytes;
+};
 
-    while((int)operators.size() > 0) {
-          performOperation(t);
-          if (evaluationErrorOccurred()) {
-              resetStacks();
-              return;
-          }
-    }
+bool writeFully(int fd, const void *src, size_t n) {
+     const char *c = (const char *)src;
+     while (n > 0) {
+            ssize_t put = write(fd, c, n);
+            if (put <= 0)
+                return false;
+            c += put;
+            n -= (size_t)put;
+     }
+     return true;
+}
+
+program_cache server_programs;
 
-    values.push_back(operands.top());
+struct serverJob {
+   std::string expr[2];
+   int_width_value width;
+   int64 first, last;
+   reply_status_value output;
+   render_mode_value mode;
+   int image_w, image_h;
+};
 
-    operands.pop();
+// one record: status, payload size, payload
+void putRecord(reply_buffer &reply, reply_status_value status, const reply_buffer &payload) {
+     reply.putU32((uint32_t)status);
+     reply.putU64((uint64_t)payload.bytes.size());
+     reply.put(payload.bytes.data(), payload.bytes.size());
 }
 
-void evaluator::performOperation(int64 t) {
+void putBadRequest(reply_buffer &reply, const std::string &msg) {
+     reply_buffer payload;
+     payload.putString(msg);
+     putRecord(reply, REPLY_BAD_REQUEST, payload);
+}
 
-    int64 result = 0LL;
-    int64 v1,v2;
-    operator_value op;
+void runServerJob(const serverJob &job, reply_buffer &reply) {
+     std::vector<int64> values[2];
+     reply_buffer payload;
 
-    v1 = operands.top();
-    operands.pop();
+     // long double holds any int64 difference exactly, int64 would overflow
+     if (job.last < job.first || (ldouble)job.last - (ldouble)job.first >= (ldouble)SERVER_MAX_SAMPLES) {
+         putBadRequest(reply, "t range is empty or too large");
+         return;
+     }
 
-    op = operators.top();
-    if (op == OPERATOR_NEG) {
-        v1 = -v1;
-        operators.pop();
-    }
-    if (op == OPERATOR_NOT) {
-        v1 = ~v1;
-        operators.pop();
-    }
+     for (int e = 0; e < 2; ++e) {
+          parse_error_value error;
+          int column;
+          std::shared_ptr<const program> prog = server_programs.lookup(job.expr[e], error, column);
 
-    if ((int)operators.size() == 0) {
-        operands.push(v1);
-        return;
-    }
-    if ((int)operators.top() < 2) {
-        operands.push(v1);
-        return;
-    }
+          if (!prog) {
+              payload.putU32((uint32_t)e);
+              payload.putU32((uint32_t)column);
+              payload.putString(parse_error_messages[error]);
+              putRecord(reply, REPLY_PARSE_ERROR, payload);
+              return;
+          }
+
+          int64 fault_t = 0;
+          fault_value fault = evaluateProgram(*prog, job.width, job.first, job.last, values[e], fault_t);
 
-    op = operators.top();
-    operators.pop();
+          if (fault != FAULT_NONE) {
+              payload.putU32((uint32_t)e);
+              payload.putU32((uint32_t)fault);
+              payload.putI64(fault_t);
+              putRecord(reply, REPLY_FAULT, payload);
+              return;
+          }
+     }
 
-    v2 = operands.top();
-    operands.pop();
+     const size_t n = values[0].size();
 
-    switch(op) {
-           case(OPERATOR_MUL):
-                result = v2 * v1;
-                break;
-           case(OPERATOR_DIV):
-                if (v1 != 0LL)
-                    result = v2 / v1;
-                else {
-                    fpe_index = t;
-                    return;
-                }
-                break;
-           case(OPERATOR_MOD):
-                if (v1 != 0LL)
-                    result = v2 % v1;
-                else {
-                    fpe_index = t;
-                    return;
-                }
-                break;
-           case(OPERATOR_ADD):
-                result = v2 + v1;
-                break;
-           case(OPERATOR_SUB):
-                result = v2 - v1;
-                break;
-           case(OPERATOR_LSF):
-                if (v1 >= MIN_SHIFTABLE_BITS &&
-                    v1 <= MAX_SHIFTABLE_BITS)
-                    result = v2 << v1;
-                else {
-                    udf_index = t;
-                    return;
+     if (job.output == REPLY_POINTS) {
+         payload.putU64((uint64_t)n);
+         payload.put(values[0].data(), n*sizeof(int64));
+         payload.put(values[1].data(), n*sizeof(int64));
+         putRecord(reply, REPLY_POINTS, payload);
+         return;
+     }
+
+     displayParameters dp;
+     dp.vis_minx = dp.vis_miny = 0.0;
+     dp.vis_maxx = dp.vis_diffx = (ldouble)job.image_w;
+     dp.vis_maxy = dp.vis_diffy = (ldouble)job.image_h;
+     dp.incx = 1;
+     dp.unsigned_values = (job.width == INT_WIDTH_U64);
+
+     ldouble minx, maxx, miny, maxy;
+     valueRange(values[0], dp.unsigned_values, minx, maxx);
+     valueRange(values[1], dp.unsigned_values, miny, maxy);
+     fitDisplayParameters(dp, minx, maxx, miny, maxy);
+
+     std::vector<ldouble> px(n), py(n);
+     for (size_t i = 0; i < n; ++i)
+          mapSample(dp, plotValue(dp, values[0][i]), plotValue(dp, values[1][i]), px[i], py[i]);
+
+     framebuffer fb;
+     tile_rasterizer rasterizer;
+     fb.resize(job.image_w, job.image_h);
+     rasterizer.render(fb, px, py, n > LINES_MAX_SAMPLES ? RENDER_MODE_POINTS : job.mode, job.image_w/2, job.image_h/2);
+
+     payload.putU32((uint32_t)job.image_w);
+     payload.putU32((uint32_t)job.image_h);
+     payload.put(fb.getPixels(), (size_t)job.image_w*(size_t)job.image_h*3);
+     putRecord(reply, REPLY_IMAGE, payload);
+}
+
+bool parseIntWidthName(const std::string &name, int_width_value &width) {
+     std::istringstream names(int_width_names);
+     std::string entry;
+     for (int i = 0; std::getline(names, entry, '|'); ++i) {
+          if (entry == name) {
+              width = (int_width_value)i;
+              return true;
+          }
+     }
+     return false;
+}
+
+// Request text, one command per line. Settings carry over to later jobs in
+// the same request, every "run" line appends one record to the reply:
+//   x <expr> / y <expr>    expressions (required)
+//   width <int8..uint64>   default int64
+//   t <first> <last>       decimal, default -2048 2048
+//   points                 reply with the x and y values (default)
+//   image <w> <h> [lines]  reply with an RGB plot
+//   run
+uint32_t runServerRequest(const std::string &request, reply_buffer &reply) {
+     serverJob job;
+     job.width = INT_WIDTH_S64;
+     job.first = SWEEP_FIRST_T;
+     job.last = SWEEP_LAST_T;
+     job.output = REPLY_POINTS;
+     job.mode = RENDER_MODE_POINTS;
+     job.image_w = job.image_h = 0;
+
+     std::istringstream in(request);
+     std::string line;
+     uint32_t records = 0;
+
+     while (std::getline(in, line)) {
+            std::istringstream args(line);
+            std::string cmd;
+            args >> cmd;
+
+            if (cmd.empty())
+                continue;
+
+            if (cmd == "x" || cmd == "y") {
+                std::string rest;
+                std::getline(args, rest);
+                rest.erase(0, rest.find_first_not_of(' '));
+                job.expr[cmd == "x" ? 0 : 1] = rest;
+                continue;
+            }
+
+            if (cmd == "width") {
+                std::string name;
+                args >> name;
+                if (parseIntWidthName(name, job.width))
+                    continue;
+            }
+            // settings are only changed by lines that are valid as a whole
+            else if (cmd == "t") {
+                int64 first, last;
+                if (args >> first >> last) {
+                    job.first = first;
+                    job.last = last;
+                    continue;
                 }
-                break;
-           case(OPERATOR_RSF):
-                if (v1 >= MIN_SHIFTABLE_BITS &&
-                    v1 <= MAX_SHIFTABLE_BITS)
-                    result = v2 >> v1;
-                else {
-                    udf_index = t;
-                    return;
+            }
+            else if (cmd == "points") {
+                job.output = REPLY_POINTS;
+                continue;
+            }
+            else if (cmd == "image") {
+                std::string mode;
+                int image_w, image_h;
+                if ((args >> image_w >> image_h) &&
+                    image_w > 0 && image_h > 0 &&
+                    image_w <= SERVER_MAX_IMAGE_SIDE && image_h <= SERVER_MAX_IMAGE_SIDE) {
+                    args >> mode;
+                    job.image_w = image_w;
+                    job.image_h = image_h;
+                    job.output = REPLY_IMAGE;
+                    job.mode = (mode == "lines") ? RENDER_MODE_LINES : RENDER_MODE_POINTS;
+                    continue;
                 }
-                break;
-           case(OPERATOR_AND):
-                result = v2 & v1;
-                break;
-           case(OPERATOR_XOR):
-                result = v2 ^ v1;
-                break;
-           case(OPERATOR_IOR):
-                result = v2 | v1;
-                break;
-           default:
-                break;
-    }
+            }
+            else if (cmd == "run") {
+                runServerJob(job, reply);
+                records++;
+                continue;
+            }
+
+            putBadRequest(reply, "bad line: " + line);
+            records++;
+     }
 
-    operands.push(result);
+     return records;
 }
 
-void evaluator::resetStacks() {
-    std::stack<operator_value>().swap(operators);
-    std::stack<int64>().swap(operands);
+// Frames: the client sends a uint32 byte count and that much request text,
+// the server answers with a uint32 record count followed by the records.
+// Answers one request, false when the reply could not be sent.
+bool serveRequest(int fd, const std::string &request) {
+     reply_buffer reply;
+     uint32_t records;
+
+     // a request too big for memory fails alone, not the whole server
+     try {
+         records = runServerRequest(request, reply);
+     }
+     catch (const std::bad_alloc &) {
+         reply = reply_buffer();
+         putBadRequest(reply, "out of memory");
+         records = 1;
+     }
+
+     return writeFully(fd, &records, sizeof(records)) &&
+            writeFully(fd, reply.bytes.data(), reply.bytes.size());
 }
 
-void evaluator::clearValues() {
-    values.resize(0);
+// moves the first complete frame out of pending; false while incomplete
+// (and for oversized frames, which are flagged through too_large)
+bool takeFrame(std::string &pending, std::string &request, bool &too_large) {
+     uint32_t len;
+
+     too_large = false;
+     if (pending.size() < sizeof(len))
+         return false;
+     std::memcpy(&len, pending.data(), sizeof(len));
+     if (len > SERVER_MAX_REQUEST_BYTES) {
+         too_large = true;
+         return false;
+     }
+     if (pending.size() - sizeof(len) < len)
+         return false;
+
+     request.assign(pending, sizeof(len), len);
+     pending.erase(0, sizeof(len) + len);
+     return true;
 }
 
-void evaluator::resetInvalidIndices() {
-    fpe_index = udf_index = VALID_CONSTANT_IND;
+// connections handed back by workers once their reply is written (with
+// false if it failed), the pipe wakes the poll loop up to watch them again
+std::mutex server_returned_mtx;
+std::vector<std::pair<int, bool> > server_returned;
+int server_wake_pipe[2];
+
+void returnConnection(int fd, bool keep) {
+     {
+          std::unique_lock<std::mutex> lock(server_returned_mtx);
+          server_returned.push_back(std::make_pair(fd, keep));
+     }
+     const char c = 0;
+     if (write(server_wake_pipe[1], &c, 1) < 0) {
+         // the pipe is full, so the poll loop is already due to wake up
+     }
 }
 
-bool evaluator::canPerformScopeOperation(operator_value current_operator) {
-     if ((int)operators.size() > 0) {
-         if ((int)operators.top() >= 2) {
-             return operator_prec[(int)operators.top()-2] <= operator_prec[(int)current_operator-2];
+// The accepting thread polls every connection that is not being served and
+// collects request bytes until a frame is complete. Only then is the request
+// queued on a pool with one worker per core, so idle or slow clients never
+// hold a worker. submit() blocks the loop once SERVER_QUEUED_REQUESTS
+// requests are waiting. Connections are closed by this thread only, so a
+// descriptor is never reused while a worker still has it.
+int runEvaluationServer(const char *path) {
+     sockaddr_un addr;
+
+     if (std::strlen(path) >= sizeof(addr.sun_path)) {
+         std::cerr << "socket path too long: " << path << std::endl;
+         return 1;
+     }
+
+     std::signal(SIGPIPE, SIG_IGN);
+
+     int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+     if (listen_fd < 0 || pipe(server_wake_pipe) < 0) {
+         std::perror("socket");
+         return 1;
+     }
+     // workers must never block on a full wake-up pipe
+     fcntl(server_wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+     std::memset(&addr, 0, sizeof(addr));
+     addr.sun_family = AF_UNIX;
+     std::strcpy(addr.sun_path, path);
+
+     // only a stale socket is replaced, anything else at path is left alone
+     struct stat existing;
+     if (lstat(path, &existing) == 0) {
+         if (!S_ISSOCK(existing.st_mode)) {
+             std::cerr << path << " exists and is not a socket" << std::endl;
+             close(listen_fd);
+             return 1;
          }
+         unlink(path);
+     }
+
+     if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+         std::perror(path);
+         close(listen_fd);
+         return 1;
+     }
+
+     thread_pool workers((int)std::max(1u, std::thread::hardware_concurrency()), SERVER_QUEUED_REQUESTS);
+     // bytes received so far for every open connection, busy ones included
+     std::map<int, std::string> pending;
+     std::vector<int> idle;
+     std::vector<pollfd> watched;
+     const timeval send_timeout = {SERVER_SEND_TIMEOUT_SECONDS, 0};
+
+     // queues the next complete request of fd, or keeps fd idle
+     auto dispatch = [&](int fd) {
+          std::string request;
+          bool too_large;
+          if (takeFrame(pending[fd], request, too_large)) {
+              workers.submit([fd, request]() { returnConnection(fd, serveRequest(fd, request)); });
+          }
+          else if (too_large) {
+              pending.erase(fd);
+              close(fd);
+          }
+          else {
+              idle.push_back(fd);
+          }
+     };
+
+     std::cout << "serving on " << path << std::endl;
+
+     for (;;) {
+          watched.resize(0);
+          watched.push_back(pollfd{listen_fd, POLLIN, 0});
+          watched.push_back(pollfd{server_wake_pipe[0], POLLIN, 0});
+          for (const auto & fd: idle)
+               watched.push_back(pollfd{fd, POLLIN, 0});
+
+          if (poll(&watched[0], (nfds_t)watched.size(), -1) < 0)
+              continue;
+
+          idle.resize(0);
+
+          for (size_t i = 2; i < watched.size(); ++i) {
+               const int fd = watched[i].fd;
+               if (watched[i].revents == 0) {
+                   idle.push_back(fd);
+                   continue;
+               }
+               char buf[65536];
+               ssize_t got = read(fd, buf, sizeof(buf));
+               if (got <= 0) {
+                   pending.erase(fd);
+                   close(fd);
+                   continue;
+               }
+               pending[fd].append(buf, (size_t)got);
+               dispatch(fd);
+          }
+
+          if (watched[1].revents != 0) {
+              char drain[64];
+              std::vector<std::pair<int, bool> > returned;
+              if (read(server_wake_pipe[0], drain, sizeof(drain)) < 0)
+                  continue;
+              {
+                   std::unique_lock<std::mutex> lock(server_returned_mtx);
+                   returned.swap(server_returned);
+              }
+              for (const auto & r: returned) {
+                   if (r.second) {
+                       dispatch(r.first);
+                   }
+                   else {
+                       pending.erase(r.first);
+                       close(r.first);
+                   }
+              }
+          }
+
+          if (watched[0].revents != 0) {
+              int fd = accept(listen_fd, NULL, NULL);
+              if (fd < 0)
+                  continue;
+              // a client that stops reading its reply only ties up a worker this long
+              setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+              pending[fd];
+              idle.push_back(fd);
+          }
      }
-     return false;
 }
 
-int evaluator::getNumValues() {
-     return (int)values.size();
+// --image <expr> <width> <height> <file.ppm> [int type]
+int runImageExport(int argc, char *argv[]) {
+     int64 width = 0, height = 0;
+     int_width_value int_width = INT_WIDTH_S64;
+
+     std::istringstream in_w(argv[3]), in_h(argv[4]);
+     if (!(in_w >> width) || !(in_h >> height) || width <= 0 || height <= 0 ||
+         width > IMAGE_MAX_SIDE || height > IMAGE_MAX_SIDE) {
+         std::cerr << "image size must be 1 to " << IMAGE_MAX_SIDE << std::endl;
+         return 1;
+     }
+     if (argc == 7 && !parseIntWidthName(argv[6], int_width)) {
+         std::cerr << "unknown integer type " << argv[6] << std::endl;
+         return 1;
+     }
+
+     expression_parser parser;
+     program prog;
+     parser.allowVariableS(true);
+     if (!parser.parse(argv[2], prog)) {
+         std::cerr << "parse error (column " << parser.getErrorColumn() << "): "
+                   << parse_error_messages[parser.getError()] << std::endl;
+         return 1;
+     }
+
+     framebuffer fb;
+     fb.resize((int)width, (int)height);
+     renderImage(prog, int_width, fb);
+
+     if (!fb.writePPM(argv[5])) {
+         std::cerr << "could not write " << argv[5] << std::endl;
+         return 1;
+     }
+     return 0;
 }
 
-std::string evaluator::getExpressionString() {
-     return expression_str;
+byte_ring::byte_ring(size_t capacity) : data(capacity), mask(capacity - 1), head(0), tail(0), closed(false) {
 }
 
-void evaluateParametricEquations(visualizer *vis) {
-     vis->resetInvalidIndices();
-     vis->getXEvaluator()->clearValues();
-     vis->getYEvaluator()->clearValues();
-     vis->getXEvaluator()->separateStringTokens(temp_global_strx);
-     vis->getYEvaluator()->separateStringTokens(temp_global_stry);
-     parse_success = !vis->parseErrorOccurred();
-     if (parse_success) {
-         for (int64 t = -2048LL; t <= 2048LL; ++t) {
-              vis->getXEvaluator()->simplifyExpression(t);
-              vis->getYEvaluator()->simplifyExpression(t);
-              if (vis->evaluationErrorOccurred())
-                  break;
-         }
-         temp_global_strx = vis->getXEvaluator()->getExpressionString();
-         temp_global_stry = vis->getYEvaluator()->getExpressionString();
+void byte_ring::write(const unsigned char *src, size_t n) {
+     while (n > 0) {
+          size_t h, room;
+          {
+               std::unique_lock<std::mutex> lock(mtx);
+               space_cv.wait(lock, [this]() { return head - tail < data.size(); });
+               h = head;
+               room = data.size() - (head - tail);
+          }
+          const size_t count = std::min(n, std::min(room, data.size() - (h & mask)));
+          std::memcpy(&data[h & mask], src, count);
+          {
+               std::unique_lock<std::mutex> lock(mtx);
+               head = h + count;
+          }
+          data_cv.notify_one();
+          src += count;
+          n -= count;
      }
-     if (!vis->evaluationErrorOccurred() && parse_success)
-         vis->updateMinMaxValues();
-     vis->redraw();
 }
 
-void evaluateButton_CB(Fl_Widget *w, void *data) {
-     Fl_Button * btn = (Fl_Button *)w;
-     if (btn->value() == 1) {
-         evaluateParametricEquations((visualizer *)data);
-         if (parse_success) {
-             inpx->value(&temp_global_strx[0]);
-             inpy->value(&temp_global_stry[0]);
-         }
+// returns 0 only once the ring is closed and drained
+size_t byte_ring::read(unsigned char *dst, size_t n) {
+     size_t t, avail;
+     {
+          std::unique_lock<std::mutex> lock(mtx);
+          data_cv.wait(lock, [this]() { return head != tail || closed; });
+          t = tail;
+          avail = head - tail;
+     }
+     if (avail == 0)
+         return 0;
+
+     const size_t count = std::min(n, std::min(avail, data.size() - (t & mask)));
+     std::memcpy(dst, &data[t & mask], count);
+     {
+          std::unique_lock<std::mutex> lock(mtx);
+          tail = t + count;
      }
+     space_cv.notify_one();
+     return count;
 }
 
-void modifyExpressionXString_CB(Fl_Widget *w, void *data) {
-     Fl_Input * inp = (Fl_Input *)w;
-     temp_global_strx = std::string(inp->value());
+void byte_ring::close() {
+     {
+          std::unique_lock<std::mutex> lock(mtx);
+          closed = true;
+     }
+     data_cv.notify_one();
 }
 
-void modifyExpressionYString_CB(Fl_Widget *w, void *data) {
-     Fl_Input * inp = (Fl_Input *)w;
-     temp_global_stry = std::string(inp->value());
+// low byte of the samples t = first .. first+n-1, faults give silence
+template <typename T>
+void evaluatePCMChunkAs(const program &prog, int64 first, int n, unsigned char *out) {
+    std::vector<T> stack((size_t)std::max(prog.getStackDepth(), 1)*TILE_SIZE);
+    unsigned char faulted[TILE_SIZE];
+
+    for (int i = 0; i < n; i += TILE_SIZE) {
+         const int lanes = std::min(TILE_SIZE, n - i);
+         evaluateRowAs<T>(prog, first + (int64)i, 0LL, lanes, &stack[0], faulted);
+         for (int k = 0; k < lanes; ++k)
+              out[i + k] = faulted[k] ? (unsigned char)BYTEBEAT_SILENCE : (unsigned char)stack[k];
+    }
+}
+
+void evaluatePCMChunk(const program &prog, int_width_value width, int64 first, int n, unsigned char *out) {
+    switch(width) {
+           case(INT_WIDTH_S8):
+                evaluatePCMChunkAs<int8_t>(prog,first,n,out);
+                return;
+           case(INT_WIDTH_U8):
+                evaluatePCMChunkAs<uint8_t>(prog,first,n,out);
+                return;
+           case(INT_WIDTH_S16):
+                evaluatePCMChunkAs<int16_t>(prog,first,n,out);
+                return;
+           case(INT_WIDTH_U16):
+                evaluatePCMChunkAs<uint16_t>(prog,first,n,out);
+                return;
+           case(INT_WIDTH_S32):
+                evaluatePCMChunkAs<int32_t>(prog,first,n,out);
+                return;
+           case(INT_WIDTH_U32):
+                evaluatePCMChunkAs<uint32_t>(prog,first,n,out);
+                return;
+           case(INT_WIDTH_U64):
+                evaluatePCMChunkAs<uint64_t>(prog,first,n,out);
+                return;
+           default:
+                break;
+    }
+    evaluatePCMChunkAs<int64_t>(prog,first,n,out);
+}
+
+void putLE(std::ostream &out, uint32_t v, int bytes) {
+     for (int i = 0; i < bytes; ++i)
+          out.put((char)(unsigned char)(v >> (8*i)));
+}
+
+// mono unsigned 8-bit PCM; an unbounded stream gets the largest even size.
+// An odd sized data chunk is followed by a pad byte that RIFF counts too.
+void writeWAVHeader(std::ostream &out, int rate, int64 num_samples) {
+     const uint32_t bytes = (num_samples < 0 || num_samples > 0x7fffffffLL) ? 0x7ffffffeu : (uint32_t)num_samples;
+
+     out.write("RIFF", 4);
+     putLE(out, 36 + bytes + (bytes & 1u), 4);
+     out.write("WAVEfmt ", 8);
+     putLE(out, 16, 4);
+     putLE(out, 1, 2);
+     putLE(out, 1, 2);
+     putLE(out, (uint32_t)rate, 4);
+     putLE(out, (uint32_t)rate, 4);
+     putLE(out, 1, 2);
+     putLE(out, 8, 2);
+     out.write("data", 4);
+     putLE(out, bytes, 4);
+}
+
+// Samples are t = 0, 1, 2, ... at the given rate (the rate only goes into
+// the WAV header). A worker thread evaluates chunks into a ring buffer ahead
+// of the writer, so a slow or real-time consumer never waits on evaluation
+// unless the expression itself is too slow. num_samples < 0 streams until
+// the output fails.
+bool streamBytebeat(const program &prog, int_width_value width, int rate, int64 num_samples, bool wav, std::ostream &out) {
+     byte_ring ring(BYTEBEAT_RING_SAMPLES);
+     std::atomic<bool> stop(false);
+
+     if (wav)
+         writeWAVHeader(out, rate, num_samples);
+
+     std::thread producer([&]() {
+          unsigned char chunk[BYTEBEAT_CHUNK_SAMPLES];
+          for (int64 t = 0; !stop.load(std::memory_order_relaxed) && (num_samples < 0 || t < num_samples); t += BYTEBEAT_CHUNK_SAMPLES) {
+               const int n = (int)((num_samples < 0) ? BYTEBEAT_CHUNK_SAMPLES : std::min((int64)BYTEBEAT_CHUNK_SAMPLES, num_samples - t));
+               evaluatePCMChunk(prog, width, t, n, chunk);
+               ring.write(chunk, (size_t)n);
+          }
+          ring.close();
+     });
+
+     unsigned char buf[BYTEBEAT_CHUNK_SAMPLES];
+     size_t n;
+
+     while ((n = ring.read(buf, sizeof(buf))) > 0) {
+          if (!out.write((const char *)buf, (std::streamsize)n)) {
+              // unblock and stop the producer, then drain what it queued
+              stop.store(true, std::memory_order_relaxed);
+              while (ring.read(buf, sizeof(buf)) > 0);
+              break;
+          }
+     }
+
+     producer.join();
+     if (wav && num_samples > 0 && (num_samples & 1) != 0)
+         out.put(0);
+     out.flush();
+     return (bool)out;
+}
+
+// --bytebeat <expr> <rate> <seconds> <file.wav | -> [int type]
+int runBytebeat(int argc, char *argv[]) {
+     int64 rate = 0, seconds = -1;
+     int_width_value int_width = INT_WIDTH_S64;
+     const std::string path = argv[5];
+
+     std::istringstream in_rate(argv[3]), in_seconds(argv[4]);
+     if (!(in_rate >> rate) || rate <= 0 || rate > BYTEBEAT_MAX_RATE) {
+         std::cerr << "sample rate must be 1 to " << BYTEBEAT_MAX_RATE << std::endl;
+         return 1;
+     }
+     // 0 seconds streams forever, which only makes sense for stdout
+     if (!(in_seconds >> seconds) || seconds < 0 || (seconds == 0 && path != "-") ||
+         (ldouble)seconds*(ldouble)rate > (ldouble)0x7fffffffLL) {
+         std::cerr << "length must be 1 to " << 0x7fffffffLL/rate << " seconds (0 for endless stdout)" << std::endl;
+         return 1;
+     }
+     if (argc == 7 && !parseIntWidthName(argv[6], int_width)) {
+         std::cerr << "unknown integer type " << argv[6] << std::endl;
+         return 1;
+     }
+
+     expression_parser parser;
+     program prog;
+     if (!parser.parse(argv[2], prog)) {
+         std::cerr << "parse error (column " << parser.getErrorColumn() << "): "
+                   << parse_error_messages[parser.getError()] << std::endl;
+         return 1;
+     }
+
+     const int64 num_samples = (seconds == 0) ? -1 : seconds*rate;
+
+     // stdout gets raw samples for piping into a player
+     if (path == "-")
+         return streamBytebeat(prog, int_width, (int)rate, num_samples, false, std::cout) ? 0 : 1;
+
+     std::ofstream out(path.c_str(), std::ios::binary);
+     if (!out || !streamBytebeat(prog, int_width, (int)rate, num_samples, true, out)) {
+         std::cerr << "could not write " << path << std::endl;
+         return 1;
+     }
+     return 0;
 }
 
 int main(int argc, char *argv[]) {
+  if (argc == 3 && std::string(argv[1]) == "--serve")
+      return runEvaluationServer(argv[2]);
+  if ((argc == 6 || argc == 7) && std::string(argv[1]) == "--image")
+      return runImageExport(argc, argv);
+  if ((argc == 6 || argc == 7) && std::string(argv[1]) == "--bytebeat")
+      return runBytebeat(argc, argv);
+
   Fl_Double_Window *window = new Fl_Double_Window(1024,600,"I64 parametric plotter");
 
   visualizer * vis = new visualizer(14,66,764,520);
@@ -864,21 +3528,62 @@ int main(int argc, char *argv[]) {
   btn->when(FL_WHEN_CHANGED);
   btn->callback(evaluateButton_CB, vis);
 
+  Fl_Choice * width_chc = new Fl_Choice(788,40,96,24);
+  width_chc->add(int_width_names);
+  width_chc->value((int)global_int_width);
+  width_chc->labelsize(12);
+  width_chc->callback(modifyIntWidth_CB);
+
+  inpt0 = new Fl_Input(914,40,96,24,"t0");
+  inpt1 = new Fl_Input(914,68,96,24,"t1");
+  inpt0->value(std::to_string(global_sweep_first).c_str());
+  inpt1->value(std::to_string(global_sweep_last).c_str());
+  inpt0->labelsize(12);
+  inpt1->labelsize(12);
+  inpt0->when(FL_WHEN_CHANGED);
+  inpt1->when(FL_WHEN_CHANGED);
+  inpt0->callback(modifySweepRange_CB);
+  inpt1->callback(modifySweepRange_CB);
+
+  Fl_Light_Button * lines_btn = new Fl_Light_Button(788,68,96,24,"LINES");
+  lines_btn->value(global_render_mode == RENDER_MODE_LINES);
+  lines_btn->labelsize(12);
+  lines_btn->callback(modifyRenderMode_CB, vis);
+
+  Fl_Button * export_btn = new Fl_Button(788,96,96,24,"EXPORT");
+  export_btn->labelsize(12);
+  export_btn->callback(exportButton_CB, vis);
+
+  Fl_Light_Button * image_btn = new Fl_Light_Button(914,96,96,24,"IMAGE");
+  image_btn->value(global_plot_mode == PLOT_MODE_IMAGE);
+  image_btn->labelsize(12);
+  image_btn->callback(modifyPlotMode_CB, vis);
+
+  Fl_Button * wav_btn = new Fl_Button(914,12,96,24,"WAV");
+  wav_btn->labelsize(12);
+  wav_btn->callback(bytebeatButton_CB, vis);
+
+  query_browser = new Fl_Browser(788,130,222,456);
+  query_browser->textsize(12);
+  query_browser->add("click or drag on the plot");
+  query_browser->add("to list the t values there");
+
   inpx->value(&temp_global_strx[0]);
   inpx->box(FL_UP_BOX);
   inpx->labelsize(12);
 
-  inpx->when(FL_WHEN_ENTER_KEY_ALWAYS|inpx->when());
-  inpx->callback(modifyExpressionXString_CB);
+  inpx->when(FL_WHEN_ENTER_KEY_ALWAYS|FL_WHEN_CHANGED|inpx->when());
+  inpx->callback(modifyExpressionXString_CB, vis);
 
   inpy->value(&temp_global_stry[0]);
   inpy->box(FL_UP_BOX);
   inpy->labelsize(12);
 
-  inpy->when(FL_WHEN_ENTER_KEY_ALWAYS|inpy->when());
-  inpy->callback(modifyExpressionYString_CB);
+  inpy->when(FL_WHEN_ENTER_KEY_ALWAYS|FL_WHEN_CHANGED|inpy->when());
+  inpy->callback(modifyExpressionYString_CB, vis);
 
   window->end();
+  window->resizable(vis);
   window->show();
 
   return Fl::run();